@@ -4,6 +4,11 @@
 #include "darksidesync_api.h"
 #include "darksidesync_aux.h"
 
+// Number of Lua states registered, the api pointer is cleared when the
+// last one unregisters. Registering and unregistering must be serialized
+// by the library if it is used from multiple Lua states.
+static int DSS_users = 0;
+
 // will get the api struct (pointer) for the api version 1v0
 // in case of errors it will provide a proper error message and call 
 // luaL_error. In case of an error the call will not return.
@@ -43,7 +48,7 @@ void DSS_initialize(lua_State *L, DSS_cancel_1v0_t pCancel)
 	DSSapi->reg(L, DSS_LibID, pCancel, &errcode);
 	if (errcode != DSS_SUCCESS)
 	{
-		DSSapi = NULL;
+		if (DSS_users == 0) DSSapi = NULL;		// other Lua states still use it
 		// The error calls below will not return
 		switch (errcode) {
 			case DSS_ERR_NOT_STARTED: luaL_error(L, "DSS was not started, or already stopped again.");
@@ -53,6 +58,7 @@ void DSS_initialize(lua_State *L, DSS_cancel_1v0_t pCancel)
 			default: luaL_error(L, "An unknown error occured while initializing DSS.");
 		}
 	}
+	DSS_users += 1;
 
 	return;
 }
@@ -106,7 +112,11 @@ void DSS_shutdown(lua_State *L, void* utilid)
 		// If we got a Lua state, go lookup our utilid
 		if (L != NULL) utilid = DSSapi->getutilid(L, DSS_LibID, NULL);
 		// Unregister
-		if (utilid != NULL) DSSapi->unreg(utilid);
-		DSSapi = NULL;
+		if (utilid != NULL && DSSapi->unreg(utilid) == DSS_SUCCESS) DSS_users -= 1;
+		if (DSS_users <= 0)
+		{
+			DSS_users = 0;
+			DSSapi = NULL;
+		}
 	}
 }
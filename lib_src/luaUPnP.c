@@ -17,6 +17,7 @@ volatile int UPnPStarted;
 static int LuaCallback(Upnp_EventType EventType, const void *Event, void *Cookie)
 {
 	int result;
+	counterInc(EventType, LPNP_COUNT_RECEIVED);
 	switch ( EventType )
 	{
 		/* SSDP Stuff */
@@ -75,11 +76,10 @@ static int LuaCallback(Upnp_EventType EventType, const void *Event, void *Cookie
 
 // Cancel method to be provide to DSS
 // when called, then DSS is shutting down, so we must also shut down
+// (UPnP itself is only finished if no other Lua state is using it)
 void DSS_cancel(void* utilid)
 {
-	UpnpFinish();					// stop UPnP threads
-	UPnPStarted = FALSE;
-	DSS_shutdown(NULL, utilid);		// unregister myself with DSS
+	shardStop(NULL, utilid);		// unregister myself with DSS, and my handles
 };
 
 static int L_UpnpInit(lua_State *L)
@@ -93,34 +93,31 @@ static int L_UpnpInit(lua_State *L)
 	if (lua_gettop(L) > 1) ipaddr = luaL_checkstring(L, 2);
 	if (lua_gettop(L) > 2) port = (unsigned short)luaL_checkint(L,3);
 
-	// first register with DSS
-	DSS_initialize(L, &DSS_cancel);	// will not return on error.
+	// register with DSS, and start UPnP if no other Lua state did yet
+	result = shardStart(L, &DSS_cancel, ipaddr, port);	// will not return on DSS errors.
+
+	lua_checkstack(L,3);
+	if (result != UPNP_E_SUCCESS) return pushUPnPerror(L, result, NULL);
 
 	// Store the callback function
-	lua_settop(L, 1);
+	lua_pushvalue(L, 1);
 	lua_setfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
+	callbackClearHandlers(L);
 
-	result = UpnpInit(ipaddr, port);
+	// start without batching, utilid might be a reused one
+	queueSetBatchSize(DSS_getutilid(L), 0);
 
-	lua_checkstack(L,3);
-	if (result == UPNP_E_SUCCESS)	
-	{
-		lua_pushinteger(L, 1);	// push 1 as positive result
-		UPnPStarted = TRUE;
-		return 1;
-	}
-	// report error
-	DSS_shutdown(L, NULL);		// shutdown DSS again
-	return pushUPnPerror(L, result, NULL);
+	lua_pushinteger(L, 1);	// push 1 as positive result
+	return 1;
 }
 
 static int L_UpnpFinish(lua_State *L)
 {
 	int result = UPNP_E_SUCCESS;
 
-	DSS_shutdown(L, NULL);		// unregister first to release all waiting threads
-
-	result = UpnpFinish();		// stop UPnP
+	// unregister from DSS first to release all waiting threads, then my
+	// handles, UPnP is stopped if this is the last Lua state using it
+	result = shardStop(L, NULL);
 
 	lua_checkstack(L,3);
 	if (result == UPNP_E_SUCCESS)	
@@ -130,7 +127,6 @@ static int L_UpnpFinish(lua_State *L)
 		lua_setfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
 
 		lua_pushinteger(L, 1);	// push 1 as positive result
-		UPnPStarted = FALSE;
 		return 1;
 	}
 	// report error
@@ -158,7 +154,11 @@ static int L_UpnpRegisterClient(lua_State *L)
 	if (result == UPNP_E_SUCCESS)
 	{
 		lc = pushLuaClient(L, handle);
-		if (lc != NULL) return 1;		// success
+		if (lc != NULL)
+		{
+			shardAddHandle(DSS_getutilid(L), handle, FALSE);
+			return 1;		// success
+		}
 		// failure, so unregister again
 		result = UpnpUnRegisterClient(handle);
 		// nil is already present on stack, add error text
@@ -178,7 +178,11 @@ static int L_UpnpRegisterRootDevice(lua_State *L)
 	if (result == UPNP_E_SUCCESS)
 	{
 		ld = pushLuaDevice(L, handle);
-		if (ld != NULL) return 1;		// success
+		if (ld != NULL)
+		{
+			shardAddHandle(DSS_getutilid(L), handle, TRUE);
+			return 1;		// success
+		}
 		// failure, so unregister again
 		result = UpnpUnRegisterRootDevice(handle);
 		// nil is already present on stack, add error text
@@ -200,7 +204,11 @@ static int L_UpnpRegisterRootDevice2(lua_State *L)
 	if (result == UPNP_E_SUCCESS)
 	{
 		ld = pushLuaDevice(L, handle);
-		if (ld != NULL) return 1;		// success
+		if (ld != NULL)
+		{
+			shardAddHandle(DSS_getutilid(L), handle, TRUE);
+			return 1;		// success
+		}
 		// failure, so unregister again
 		result = UpnpUnRegisterRootDevice(handle);
 		// nil is already present on stack, add error text
@@ -213,7 +221,11 @@ static int L_UpnpRegisterRootDevice2(lua_State *L)
 
 static int L_UpnpUnRegisterClient(lua_State *L)
 {
-	int result = UpnpUnRegisterClient(checkclient(L, 1));
+	UpnpClient_Handle handle = checkclient(L, 1);
+	int result;
+	// only unregister handles registered by this Lua state
+	if (! shardRemoveHandle(shardGetUtilid(L), handle, FALSE)) return pushUPnPerror(L, UPNP_E_INVALID_HANDLE, NULL);
+	result = UpnpUnRegisterClient(handle);
 	if (result != UPNP_E_SUCCESS) return pushUPnPerror(L, result, NULL);
 	lua_pushinteger(L, 1);
 	return 1;
@@ -221,7 +233,12 @@ static int L_UpnpUnRegisterClient(lua_State *L)
 
 static int L_UpnpUnRegisterRootDevice(lua_State *L)
 {
-	int result = UpnpUnRegisterRootDevice(checkdevice(L, 1));
+	UpnpDevice_Handle handle = checkdevice(L, 1);
+	int result;
+	// only unregister handles registered by this Lua state
+	if (! shardRemoveHandle(shardGetUtilid(L), handle, TRUE)) return pushUPnPerror(L, UPNP_E_INVALID_HANDLE, NULL);
+	result = UpnpUnRegisterRootDevice(handle);
+	storeRemove(handle);
 	if (result != UPNP_E_SUCCESS) return pushUPnPerror(L, result, NULL);
 	lua_pushinteger(L, 1);
 	return 1;
@@ -350,14 +367,70 @@ static int L_UpnpAcceptSubscriptionExt(lua_State *L)
 	return 1;
 }
 
+// Number of variables that can be notified without allocating the arrays
+#define LPNP_NOTIFY_STATIC 16
+
+// Gets element 'i' of the array at 'idx' as a string. Strings are anchored
+// by the array, converted numbers are left on the stack to anchor them.
+static const char* getarraystring(lua_State *L, int idx, int i)
+{
+	const char* result;
+	lua_rawgeti(L, idx, i);
+	if (lua_type(L, -1) == LUA_TSTRING)
+	{
+		result = lua_tostring(L, -1);
+		lua_pop(L, 1);
+		return result;
+	}
+	if (lua_type(L, -1) != LUA_TNUMBER)
+		luaL_error(L, "expected a string or number at index %d of the names/values arrays", i);
+	if (!lua_checkstack(L, 2)) luaL_error(L, "too many numeric values to notify");
+	return lua_tostring(L, -1);
+}
+
+// Params: device, udn, serviceid, and either a variable name and value,
+// or 2 arrays (numbered tables) with the names and the values. The arrays
+// are passed to pupnp as is, no property set document is created.
 static int L_UpnpNotify(lua_State *L)
 {
 	UpnpDevice_Handle dev = checkdevice(L,1);
 	const char* udn = luaL_checkstring(L,2);
 	const char* service = luaL_checkstring(L,3);
-	const char* name = luaL_checkstring(L,4);
-	const char* value = luaL_checkstring(L,5);
-	int result = UpnpNotify(dev, udn, service, (const char**)&name, (const char**)&value, 1);
+	const char* staticnames[LPNP_NOTIFY_STATIC];
+	const char* staticvalues[LPNP_NOTIFY_STATIC];
+	const char** names = staticnames;
+	const char** values = staticvalues;
+	int count = 1;
+	int i, result;
+
+	if (lua_istable(L, 4))
+	{
+		luaL_checktype(L, 5, LUA_TTABLE);
+		count = (int)lua_objlen(L, 4);
+		luaL_argcheck(L, count == (int)lua_objlen(L, 5), 5, "names and values arrays must have the same length");
+		lua_settop(L, 5);
+		if (count == 0)
+		{
+			lua_pushinteger(L, 1);	// nothing to notify
+			return 1;
+		}
+		if (count > LPNP_NOTIFY_STATIC)
+		{
+			names = (const char**)lua_newuserdata(L, 2 * count * sizeof(const char*));
+			values = names + count;
+		}
+		for (i = 0; i < count; i++)
+		{
+			names[i] = getarraystring(L, 4, i + 1);
+			values[i] = getarraystring(L, 5, i + 1);
+		}
+	}
+	else
+	{
+		names[0] = luaL_checkstring(L,4);
+		values[0] = luaL_checkstring(L,5);
+	}
+	result = UpnpNotify(dev, udn, service, names, values, count);
 	if (result != UPNP_E_SUCCESS)	return pushUPnPerror(L, result, NULL);
 	lua_pushinteger(L, 1);
 	return 1;
@@ -715,8 +788,8 @@ static int L_UpnpAddToActionResponse(lua_State *L)
 static int L_UpnpAddToPropertySet(lua_State *L)
 {
 	int result = UPNP_E_SUCCESS;
-	const char* ArgName = luaL_checkstring(L,4);
-	const char* ArgVal = luaL_checkstring(L,5);
+	const char* ArgName = luaL_checkstring(L,2);
+	const char* ArgVal = luaL_checkstring(L,3);
 	IXML_Document* doc = NULL;
 	if (! lua_isnil(L,1))	doc = checkdocument(L, 1);
 
@@ -732,51 +805,37 @@ static int L_UpnpAddToPropertySet(lua_State *L)
 }
 
 // Param list modified; no numer and no args, just a table, key-values
+// The property set is serialized and parsed once, instead of adding each
+// variable to the document.
 static int L_UpnpCreatePropertySet(lua_State *L)
 {
 	const char* ArgName = NULL;
 	const char* ArgVal = NULL;
+	size_t len = 0;
 	int result = UPNP_E_SUCCESS;
-	IXML_Document* doc = UpnpCreatePropertySet(0, NULL);
+	IXML_Document* doc = NULL;
+	xmlbuffer b;
 
-	if (doc != NULL)
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+	xmlInit(&b, 512);
+	xmlStartPropertySet(&b);
+	lua_pushnil(L);  /* first key */
+	while (lua_next(L, 1) != 0) {
+		/* uses 'key' (at index -2) and 'value' (at index -1) */
+		// copy the key, to prevent conversion to a string, as it would break 'lua_next'
+		lua_pushvalue(L, -2);
+		ArgName = (lua_isstring(L, -1) ? lua_tostring(L, -1) : NULL);
+		ArgVal = (lua_isstring(L, -2) ? lua_tolstring(L, -2, &len) : NULL);
+		xmlAddProperty(&b, ArgName, ArgVal, len);
+		/* removes 'value' and the copy; keeps 'key' for next iteration */
+		lua_pop(L, 2);
+	}
+	xmlEndPropertySet(&b);
+	result = xmlParse(&b, &doc);
+	if (result != UPNP_E_SUCCESS)
 	{
-		if (lua_gettop(L) > 2 && lua_istable(L,1))
-		{
-			/* table is in the stack at index 't' */
-			lua_pushnil(L);  /* first key */
-			while (lua_next(L, 1) != 0) {
-				/* uses 'key' (at index -2) and 'value' (at index -1) */
-				if (lua_type(L,-2) == LUA_TSTRING)
-				{
-					ArgName = lua_tostring(L, -2);
-					ArgVal = lua_tostring(L, -1);
-					result = UpnpAddToPropertySet(&doc, ArgName, ArgVal);
-				}
-				else
-				{
-					// key is not a string, must make a copy to prevent conversion to a string
-					lua_pushvalue(L,-2);		// copy name to new stack pos, where it will be converted
-					ArgName = lua_tostring(L, -1);
-					ArgVal = lua_tostring(L, -2);
-					result = UpnpAddToPropertySet(&doc, ArgName, ArgVal);
-					lua_pop(L, 1);	// pop the copy
-				}
-				/* removes 'value'; keeps 'key' for next iteration */
-				lua_pop(L, 1);
-				if (result != UPNP_E_SUCCESS)
-				{
-					ixmlDocument_free(doc);
-					return luaL_error(L, "Error adding argument names and values to the Propertyset");
-				}
-			}
-		}
-		else
-		{
-			// 3rd argument is missing or not a table
-			ixmlDocument_free(doc);
-			return luaL_error(L, "argument error, 3rd argument; expected a table");
-		}
+		return luaL_error(L, "Error adding argument names and values to the Propertyset");
 	}
 	pushLuaDocument(L, doc);
 	return 1;
@@ -803,6 +862,360 @@ static int L_UpnpCreatePropertySet(lua_State *L)
 */
 
 
+/*
+** ===============================================================
+** LuaUPnP specific: event delivery
+** ===============================================================
+*/
+
+// Sets the maximum number of async events delivered in a single callback.
+// When > 0, the callback receives an array of event tables instead of a
+// single event. Blocking (device) events are always delivered individually.
+// 0 disables batching.
+static int L_SetBatchDelivery(lua_State *L)
+{
+	int size = luaL_checkint(L, 1);
+	luaL_argcheck(L, size >= 0 && size <= LPNP_MAX_BATCHSIZE, 1, "batch size out of range");
+	queueSetBatchSize(DSS_getutilid(L), size);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Starts delivery of async events through the lock-free ring, bypassing DSS.
+// Params: 1) UDP port on localhost, to be signalled when events are waiting
+//         2) size of the ring (max number of waiting events)
+// Events that do not fit in the ring are dropped. Blocking (device) events
+// and errors are always delivered through DSS.
+static int L_SetRingDelivery(lua_State *L)
+{
+	unsigned short port = (unsigned short)luaL_checkint(L, 1);
+	int size = luaL_checkint(L, 2);
+	int result = ringStart(DSS_getutilid(L), port, size);
+	if (result != UPNP_E_SUCCESS) return pushUPnPerror(L, result, NULL);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns an array of event tables (with field 'n') drained from the ring,
+// or nil + error if the ring is not owned by the calling Lua state
+static int L_DrainRing(lua_State *L)
+{
+	if (ringDrain(L, shardGetUtilid(L)) != DSS_SUCCESS)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "ring delivery is not started by this Lua state");
+		return 2;
+	}
+	return 1;
+}
+
+// Returns a table with the ring statistics, or nil if the ring is not in use
+static int L_GetRingStats(lua_State *L)
+{
+	ringPushStats(L);
+	return 1;
+}
+
+// Sets the limit for the number of events in flight for an event class, for
+// the events delivered to the calling Lua state.
+// Params: 1) event class; "SSDP", "SOAP", "GENA" or "DEVICE"
+//         2) max number of events delivered, but not yet handled by Lua, 0 = unlimited
+//         3) policy when the limit is reached; "dropoldest", "dropnewest" or "block"
+// Dropped device requests are answered with an error (actions) or not accepted
+// (subscriptions). "dropoldest" requires batch delivery to be enabled first.
+// "block" is only allowed for "DEVICE"; the pupnp threads delivering the other
+// classes are shared with the SSDP/HTTP servers, blocking them would starve
+// the stack.
+static int L_SetQueueLimit(lua_State *L)
+{
+	int eventclass = queueClassByName(luaL_checkstring(L, 1));
+	int limit = luaL_checkint(L, 2);
+	int policy = queuePolicyByName(luaL_optstring(L, 3, "dropnewest"));
+	luaL_argcheck(L, eventclass >= 0, 1, "expected 'SSDP', 'SOAP', 'GENA' or 'DEVICE'");
+	luaL_argcheck(L, limit >= 0, 2, "limit cannot be negative");
+	luaL_argcheck(L, policy >= 0, 3, "expected 'dropoldest', 'dropnewest' or 'block'");
+	luaL_argcheck(L, policy != LPNP_POLICY_BLOCK || eventclass == LPNP_CLASS_DEVICE, 3, "'block' is only allowed for 'DEVICE'");
+	luaL_argcheck(L, policy != LPNP_POLICY_DROPOLDEST || queueGetBatchSize(DSS_getutilid(L)) > 0, 3, "'dropoldest' requires batch delivery");
+	if (!queueSetLimit(DSS_getutilid(L), eventclass, limit, policy)) luaL_error(L, "Out of memory");
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with limit, policy and counters for each event class, of
+// the calling Lua state
+static int L_GetQueueStats(lua_State *L)
+{
+	queuePushStats(L, shardGetUtilid(L));
+	return 1;
+}
+
+// Sets the size of the SSDP deduplication cache (max number of entries).
+// Repeated advertisements are not delivered to Lua while cached. 0 disables
+// deduplication. The cache is shared by all Lua states, so it can only be
+// changed while a single Lua state has UPnP started; returns nil + error
+// otherwise.
+static int L_SetDedupCache(lua_State *L)
+{
+	int size = luaL_checkint(L, 1);
+	luaL_argcheck(L, size >= 0 && size <= LPNP_MAX_DEDUPSIZE, 1, "cache size out of range");
+	if (shardCount() > 1)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "the cache is shared by multiple Lua states, its size cannot be changed");
+		return 2;
+	}
+	dedupSetSize(size);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Clears the SSDP deduplication cache of the calling Lua state, so all
+// advertisements will be delivered again
+static int L_ClearDedupCache(lua_State *L)
+{
+	dedupClear(DSS_getutilid(L));
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the SSDP deduplication counters
+static int L_GetDedupStats(lua_State *L)
+{
+	dedupPushStats(L);
+	return 1;
+}
+
+// Sets the handler for a single event type, called instead of the callback
+// passed to Init(). Once a handler is set, event types without a handler are
+// dropped by the core lib. Batches (and the ring) are still delivered to the
+// Init() callback, as are errors.
+// Params: 1) event type name, eg. "UPNP_DISCOVERY_SEARCH_RESULT"
+//         2) handler function, or nil to remove the handler
+static int L_SetEventHandler(lua_State *L)
+{
+	int et = callbackEventType(luaL_checkstring(L, 1));
+	luaL_argcheck(L, et >= 0, 1, "unknown event type");
+	luaL_argcheck(L, lua_isfunction(L, 2) || lua_isnoneornil(L, 2), 2, "expected a function or nil");
+	lua_settop(L, 2);
+	callbackSetHandler(L, (Upnp_EventType)et, 2);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Enables/disables delivery of async events as lazy event objects. The
+// objects are userdatas that create the field values only when accessed,
+// instead of building a table with all fields (and document wrappers) for
+// each event. They cannot be traversed with 'pairs' and are read-only.
+// Applies to the calling Lua state only, until it stops UPnP.
+static int L_SetLazyEvents(lua_State *L)
+{
+	callbackSetLazy(L, lua_toboolean(L, 1));
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Sets the number of async event tables recycled by the calling Lua state,
+// 0 disables recycling. By enabling it, the callback and handlers declare
+// they do not keep the event tables after returning; the tables are cleared
+// and reused by the next delivery. Has no effect on lazy event objects.
+static int L_SetEventRecycling(lua_State *L)
+{
+	int size = luaL_checkint(L, 1);
+	luaL_argcheck(L, size >= 0 && size <= LPNP_MAX_EVENTPOOL, 1, "pool size out of range");
+	recycleSetSize(L, size);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the fields 'size' (of the pool of the calling Lua
+// state), 'reused' (table allocations avoided) and 'created'.
+static int L_GetRecycleStats(lua_State *L)
+{
+	recyclePushStats(L);
+	return 1;
+}
+
+// Enables/disables positional arguments for action requests. Instead of a
+// 'Params' table keyed by the argument names, the event then has a
+// 'ParamNames' array with the lowercased names and a 'ParamValues' array with
+// the values, both in document order. Applies to the calling Lua state only,
+// until it stops UPnP.
+static int L_SetPositionalParams(lua_State *L)
+{
+	callbackSetPositional(L, lua_toboolean(L, 1));
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the hit/miss statistics of the allocation pools
+static int L_GetPoolStats(lua_State *L)
+{
+	poolPushStats(L);
+	return 1;
+}
+
+// Sets the deadline (in milliseconds) for action and subscription requests
+// waiting for a Lua response. When it passes, the action is answered with
+// 501 'Action Failed' and the subscription is not accepted. A late response
+// is discarded; calling the callback then returns nil + error. 0 waits
+// indefinitely (default). Applies to the requests for the devices of the
+// calling Lua state only, until it stops UPnP.
+static int L_SetRequestDeadline(lua_State *L)
+{
+	int ms = luaL_checkint(L, 1);
+	luaL_argcheck(L, ms >= 0 && ms <= LPNP_MAX_DEADLINE, 1, "deadline out of range");
+	callbackSetDeadline(L, ms);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the deadline and the delivered/answered/expired/late
+// counters of the requests delivered with a deadline
+static int L_GetRequestStats(lua_State *L)
+{
+	pendingPushStats(L, callbackGetDeadline(shardGetUtilid(L)));
+	return 1;
+}
+
+// Enables/disables the latency statistics. When enabled, events are
+// timestamped at each stage of the callback pipeline; queued, decoded, Lua
+// handler returned (requests only) and completed.
+static int L_SetLatencyStats(lua_State *L)
+{
+	latencySetEnabled(lua_toboolean(L, 1));
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the latency statistics in microseconds, by event type
+// name. Each has tables for the stages 'queue', 'decode', 'lua', 'return' and
+// the 'total', with the fields 'count', 'mean', 'max', 'p50', 'p90', 'p99'
+// and 'p999'.
+static int L_GetLatencyStats(lua_State *L)
+{
+	latencyPushStats(L);
+	return 1;
+}
+
+// Resets the latency statistics
+static int L_ClearLatencyStats(lua_State *L)
+{
+	latencyClear();
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the delivery counters by event type name. Each has the
+// fields 'received', 'delivered', 'decoded', 'dropped', 'oom', 'dsserror',
+// 'cancelled', 'inflight' and 'peak'.
+static int L_GetCounters(lua_State *L)
+{
+	countersPushStats(L);
+	return 1;
+}
+
+// Resets the delivery counters, the peaks are reset to the current number
+// of events in flight
+static int L_ClearCounters(lua_State *L)
+{
+	countersClear();
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the fields 'states' (number of Lua states that
+// started UPnP), 'started' (whether the calling state did), and 'devices'
+// and 'clients' (number of handles registered by the calling state).
+static int L_GetShardStats(lua_State *L)
+{
+	shardPushStats(L);
+	return 1;
+}
+
+// Returns a table with the fields 'reported' (internal errors), 'deliveries'
+// (DSS deliveries used to report them, repeats are coalesced), 'lost' and
+// 'waiting' (not yet picked up by Lua).
+static int L_GetErrorStats(lua_State *L)
+{
+	errorsPushStats(L);
+	return 1;
+}
+
+
+/*
+** ===============================================================
+** LuaUPnP specific: native state store
+** ===============================================================
+*/
+
+// Adds a statevariable to the native state store (or updates it).
+// Params: 1) root device (handle), 2) UDN, 3) serviceid, 4) variable name,
+//         5) value (UPnP format), 6) evented (boolean)
+// Only evented variables are included when accepting a subscription.
+static int L_StoreAddVariable(lua_State *L)
+{
+	UpnpDevice_Handle handle = checkdevice(L, 1);
+	int result = storeAddVariable(handle, luaL_checkstring(L, 2), luaL_checkstring(L, 3),
+		luaL_checkstring(L, 4), luaL_checkstring(L, 5), lua_toboolean(L, 6));
+	if (result != UPNP_E_SUCCESS) return pushUPnPerror(L, result, NULL);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Updates a statevariable value in the native state store.
+// Params: 1) UDN, 2) serviceid, 3) variable name, 4) value (UPnP format)
+// Returns 1 if updated, or nil if the variable is not in the store
+static int L_StoreSetVariable(lua_State *L)
+{
+	if (storeSetVariable(luaL_checkstring(L, 1), luaL_checkstring(L, 2), luaL_checkstring(L, 3), luaL_checkstring(L, 4)))
+		lua_pushinteger(L, 1);
+	else
+		lua_pushnil(L);
+	return 1;
+}
+
+// Adds a getter action to the native state store, it will be answered from
+// the stored values, without calling Lua.
+// Params: 1) UDN, 2) serviceid, 3) action name, 4) array with 'out' argument
+//         names, 5) array with the related statevariable names (must be stored)
+static int L_StoreAddGetter(lua_State *L)
+{
+	const char** args;
+	const char** vars;
+	int count, i, result;
+	const char* udn = luaL_checkstring(L, 1);
+	const char* serviceid = luaL_checkstring(L, 2);
+	const char* action = luaL_checkstring(L, 3);
+
+	luaL_checktype(L, 4, LUA_TTABLE);
+	luaL_checktype(L, 5, LUA_TTABLE);
+	count = (int)lua_objlen(L, 4);
+	luaL_argcheck(L, count == (int)lua_objlen(L, 5), 5, "expected as many variable names as argument names");
+	args = (const char**)lua_newuserdata(L, sizeof(char*) * (count + 1));	// collected by Lua
+	vars = (const char**)lua_newuserdata(L, sizeof(char*) * (count + 1));
+	for (i = 0; i < count; i++)
+	{
+		lua_rawgeti(L, 4, i + 1);
+		args[i] = lua_tostring(L, -1);
+		lua_rawgeti(L, 5, i + 1);
+		vars[i] = lua_tostring(L, -1);
+		luaL_argcheck(L, args[i] != NULL && vars[i] != NULL, 4, "expected arrays of strings");
+		lua_pop(L, 2);	// strings remain referenced by the tables
+	}
+	result = storeAddGetter(udn, serviceid, action, count, args, vars);
+	if (result != UPNP_E_SUCCESS) return pushUPnPerror(L, result, NULL);
+	lua_pushinteger(L, 1);
+	return 1;
+}
+
+// Returns a table with the native state store counters
+static int L_GetStoreStats(lua_State *L)
+{
+	storePushStats(L);
+	return 1;
+}
+
+
 /*
 ** ===============================================================
 ** Library initialization / shutdown
@@ -846,6 +1259,36 @@ static const struct luaL_Reg UPnPfunctions[] = {
 	{"SubscribeAsync",L_UpnpSubscribeAsync},
 	{"UnSubscribe",L_UpnpUnSubscribe},
 	{"UnSubscribeAsync",L_UpnpUnSubscribeAsync},
+	// Event delivery
+	{"SetBatchDelivery",L_SetBatchDelivery},
+	{"SetLazyEvents",L_SetLazyEvents},
+	{"SetEventRecycling",L_SetEventRecycling},
+	{"GetRecycleStats",L_GetRecycleStats},
+	{"SetPositionalParams",L_SetPositionalParams},
+	{"SetEventHandler",L_SetEventHandler},
+	{"SetQueueLimit",L_SetQueueLimit},
+	{"GetQueueStats",L_GetQueueStats},
+	{"GetPoolStats",L_GetPoolStats},
+	{"SetDedupCache",L_SetDedupCache},
+	{"ClearDedupCache",L_ClearDedupCache},
+	{"GetDedupStats",L_GetDedupStats},
+	{"SetRingDelivery",L_SetRingDelivery},
+	{"DrainRing",L_DrainRing},
+	{"GetRingStats",L_GetRingStats},
+	{"SetRequestDeadline",L_SetRequestDeadline},
+	{"GetRequestStats",L_GetRequestStats},
+	{"SetLatencyStats",L_SetLatencyStats},
+	{"GetLatencyStats",L_GetLatencyStats},
+	{"ClearLatencyStats",L_ClearLatencyStats},
+	{"GetCounters",L_GetCounters},
+	{"ClearCounters",L_ClearCounters},
+	{"GetShardStats",L_GetShardStats},
+	{"GetErrorStats",L_GetErrorStats},
+	// Native state store
+	{"StoreAddVariable",L_StoreAddVariable},
+	{"StoreSetVariable",L_StoreSetVariable},
+	{"StoreAddGetter",L_StoreAddGetter},
+	{"GetStoreStats",L_GetStoreStats},
 
 	{NULL,NULL}
 };
@@ -953,14 +1396,37 @@ static const struct luaL_Reg UPnPUtil[] = {
 // Note: check Lua os.exit() function for exceptions,
 // it will not always be called!
 static int L_closeLib(lua_State *L) {
-	// shutdown DSS first to cancel all waiting threads and release them
-	DSS_shutdown(L, NULL);
-	// stop UPnP
-	UpnpFinish();
-	UPnPStarted = FALSE;
+	// shutdown DSS first to cancel all waiting threads and release them,
+	// then stop UPnP, if no other Lua state is using it
+	shardStop(L, NULL);
 	return 0;
 }
 
+// Sets up the process wide module data; the allocation pools, the batch queues, the SSDP cache, the state store,
+// request deadlines, statistics, the event handlers, the Lua states sharing UPnP and the error reporting.
+// Multiple Lua states (threads) may open the lib simultaneously, so it runs exactly once through the OS.
+#ifdef WIN32
+static INIT_ONCE initonce = INIT_ONCE_STATIC_INIT;
+static BOOL CALLBACK initializeModules(PINIT_ONCE once, PVOID param, PVOID* context)
+#else
+static pthread_once_t initonce = PTHREAD_ONCE_INIT;
+static void initializeModules(void)
+#endif
+{
+	poolInitialize();
+	queueInitialize();
+	dedupInitialize();
+	storeInitialize();
+	pendingInitialize();
+	latencyInitialize();
+	callbackInitialize();
+	shardInitialize();
+	errorsInitialize();
+#ifdef WIN32
+	return TRUE;
+#endif
+}
+
 LPNP_API	int luaopen_upnp_core(lua_State *L)
 {
 
@@ -968,8 +1434,11 @@ LPNP_API	int luaopen_upnp_core(lua_State *L)
 	//  Create lib close userdata
 	/////////////////////////////////////////////
 
-	// tracker for library being started or not
-	UPnPStarted = FALSE;	// TODO: dangerous if lib gets loaded more than once, should also have a counter to inc/dec upon init/shutdown to prevent shutting down other Lua state
+#ifdef WIN32
+	InitOnceExecuteOnce(&initonce, &initializeModules, NULL, NULL);
+#else
+	pthread_once(&initonce, &initializeModules);
+#endif
 
 	// first register with DSS
 	//DSS_initialize(L, &DSS_cancel);	// will not return on error.   --> will be done upon starting UPnP
@@ -1056,6 +1525,36 @@ LPNP_API	int luaopen_upnp_core(lua_State *L)
 	// Register the methods of the object
 	luaL_register(L, NULL, UPnPClientMethods);
 
+	/* setup lazy event objects */
+
+	// Create a new metatable for the events
+	luaL_newmetatable(L, LPNP_EVENT_MT);
+	lua_pushcfunction(L, L_EventIndex);
+	lua_setfield(L, -2, "__index");
+	// Add GC method
+	lua_pushcfunction(L, L_DestroyEvent);
+	lua_setfield(L, -2, "__gc");
+	// add tostring method
+	lua_pushcfunction(L, L_eventtostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pop(L, 1);
+
+	// Metatable for action request event tables, wraps the documents on first access
+	luaL_newmetatable(L, LPNP_ACTIONREQUEST_MT);
+	lua_pushcfunction(L, L_ActionRequestIndex);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	/* setup pending request callbacks (requests with a deadline) */
+
+	luaL_newmetatable(L, LPNP_PENDING_MT);
+	lua_pushcfunction(L, L_PendingCall);
+	lua_setfield(L, -2, "__call");
+	// Add GC method, fails the request if left unanswered
+	lua_pushcfunction(L, L_DestroyPending);
+	lua_setfield(L, -2, "__gc");
+	lua_pop(L, 1);
+
 	// Create reference table for the userdatas (devices and clients/controlpoints)
 	lua_newtable(L);				// table
 	lua_newtable(L);				// meta table
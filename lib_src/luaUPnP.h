@@ -1,6 +1,11 @@
 #ifndef LuaUPnP_h
 #define LuaUPnP_h
 
+#ifdef WIN32
+	#include <windows.h>
+#else
+	#include <pthread.h>
+#endif
 #include "upnp.h"
 #include "upnptools.h"
 //#include "uuid.h"
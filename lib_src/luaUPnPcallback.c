@@ -12,20 +12,6 @@ static IXML_Document* copyIXMLdoc(IXML_Document* inputDoc)
 	return (IXML_Document*)ixmlNode_cloneNode((IXML_Node*)inputDoc, TRUE);
 }
 
-// =================== Error reporting ===========================
-static int decodeUpnpCallbackError(lua_State *L, void* pData, void* utilid)
-{
-	// Push the callback function first
-	lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
-	lua_pushnil(L);
-	lua_pushstring(L, (char*)pData);
-	return 3;
-}
-static int deliverUpnpCallbackError(const char* msg, void* cookie)
-{
-	//TODO: must copy the string, and release upon decoding
-	return DSS_deliver(cookie, &decodeUpnpCallbackError, NULL, (void*)msg);
-}
 // =================== Push string if not NULL ===================
 // requires table to add it to to be on top of the stack
 static void pushstringfield(lua_State *L, const char* key, const char* value)
@@ -38,387 +24,918 @@ static void pushstringfield(lua_State *L, const char* key, const char* value)
 	}
 }
 
-// =================== Discovery events ==========================
-static int decodeUpnpDiscovery(lua_State *L, void* pData, void* utilid)
+// =================== Event handlers ============================
+// By default all events are delivered to the callback passed to Init().
+// Once a handler has been set for a specific event type, events are
+// delivered to their own handler, and event types without a handler are
+// dropped before anything is allocated. Errors always go to the callback.
+
+// Handlers are kept per Lua state (by DSS utilid), as each state has its
+// own registry. The same record holds the delivery options of the state,
+// as several states may share the UPnP stack, each with its own options.
+// Records are never released, a utilid is reused by DSS.
+
+typedef struct _cbhandlers {
+	void* utilid;
+	int refs[LPNP_EVENTTYPES];				// registry refs, LUA_NOREF if not set
+	volatile int count;						// number of handlers set
+	volatile int lazy;						// deliver async events as lazy event objects
+	volatile int positional;				// deliver action arguments as arrays
+	volatile int deadline;					// for blocking requests in ms, 0 = none
+	struct _cbhandlers* next;
+} cbhandlers;
+
+static cbhandlers* volatile handlerlist = NULL;
+static ithread_mutex_t handlerlock;
+static ithread_mutex_t actionlock;		// see 'Action requests' below
+
+void callbackInitialize()
 {
-	int result = 0;
-	cbdelivery* mydata = (cbdelivery*)pData;
-	UpnpDiscovery* dEvent = (UpnpDiscovery*)mydata->Event;
+	ithread_mutex_init(&handlerlock, NULL);
+	ithread_mutex_init(&actionlock, NULL);
+}
 
-	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
-	if (L != NULL)
+// Returns the handlers of a Lua state, or NULL if none were ever set.
+// Records are only added at the head, so the list can be read unlocked.
+static cbhandlers* findHandlers(void* utilid)
+{
+	cbhandlers* h = handlerlist;
+	while (h != NULL && h->utilid != utilid) h = h->next;
+	return h;
+}
+
+// Returns the handlers of a Lua state, creates them if not found
+static cbhandlers* getHandlers(lua_State *L)
+{
+	void* utilid = DSS_getutilid(L);	// will not return on error
+	cbhandlers* h;
+	int i;
+
+	ithread_mutex_lock(&handlerlock);
+	h = findHandlers(utilid);
+	if (h == NULL)
 	{
-		// Push the callback function first
-		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
-		// Create and fill the event table for Lua
-		lua_newtable(L);
-		pushstringfield(L, "Event", UpnpGetEventType(mydata->EventType));
-		if (dEvent != NULL)
+		h = (cbhandlers*)malloc(sizeof(cbhandlers));
+		if (h == NULL)
 		{
-			if (UpnpDiscovery_get_ErrCode(dEvent) != UPNP_E_SUCCESS)
-			{
-				lua_pushstring(L, "ErrCode");
-				lua_pushinteger(L, UpnpDiscovery_get_ErrCode(dEvent));
-				lua_settable(L, -3);
-				pushstringfield(L, "Error", UpnpGetErrorMessage(UpnpDiscovery_get_ErrCode(dEvent)));
-			}
-			lua_pushstring(L, "Expires");
-			lua_pushinteger(L, UpnpDiscovery_get_Expires(dEvent));
-			lua_settable(L, -3);
-			pushstringfield(L, "DeviceID", UpnpString_get_String(UpnpDiscovery_get_DeviceID(dEvent)));
-			pushstringfield(L, "DeviceType", UpnpString_get_String(UpnpDiscovery_get_DeviceType(dEvent)));
-			pushstringfield(L, "ServiceType", UpnpString_get_String(UpnpDiscovery_get_ServiceType(dEvent)));
-			pushstringfield(L, "ServiceVer", UpnpString_get_String(UpnpDiscovery_get_ServiceVer(dEvent)));
-			pushstringfield(L, "Location", UpnpString_get_String(UpnpDiscovery_get_Location(dEvent)));
-			pushstringfield(L, "Os", UpnpString_get_String(UpnpDiscovery_get_Os(dEvent)));
-			pushstringfield(L, "Date", UpnpString_get_String(UpnpDiscovery_get_Date(dEvent)));
-			pushstringfield(L, "Ext", UpnpString_get_String(UpnpDiscovery_get_Ext(dEvent)));
-			// TODO: add address info, check *NIX vs Win32 differences, and IPv4 vs IPv6
-			//lua_pushstring(L, "DestAddr");
-			//lua_pushstring(L, UpnpDiscovery_get_DestAddr(dEvent));
-			//lua_settable(L, -3);
+			ithread_mutex_unlock(&handlerlock);
+			luaL_error(L, "Out of memory");
 		}
-		result = 2;	// 2 return arguments, callback + table
+		h->utilid = utilid;
+		for (i = 0; i < LPNP_EVENTTYPES; i++) h->refs[i] = LUA_NOREF;
+		h->count = 0;
+		h->lazy = FALSE;
+		h->positional = FALSE;
+		h->deadline = 0;
+		h->next = handlerlist;
+		LPNP_BARRIER();			// record complete before it is published
+		handlerlist = h;
 	}
-	if (dEvent != NULL) UpnpDiscovery_delete(dEvent);
-	free(mydata);
-	return result;
+	ithread_mutex_unlock(&handlerlock);
+	return h;
 }
 
-int deliverUpnpDiscovery(Upnp_EventType EventType, const UpnpDiscovery *dEvent, void* cookie)
+// Looks up the event type by its name, returns -1 if not found
+int callbackEventType(const char* name)
 {
-	int err = DSS_SUCCESS;
-	cbdelivery* mydata = (cbdelivery*)malloc(sizeof(cbdelivery));
+	size_t i;
+	for (i = 0; i < sizeof(EventTypes) / sizeof(EventTypes[0]); i++)
+	{
+		if (strcmp(name, EventTypes[i].etTypeDesc) == 0) return EventTypes[i].et;
+	}
+	return -1;
+}
+
+// Sets the handler for an event type to the function at 'idx', or removes
+// it if the value at 'idx' is nil.
+void callbackSetHandler(lua_State *L, Upnp_EventType EventType, int idx)
+{
+	cbhandlers* h = getHandlers(L);
+
+	if (h->refs[EventType] != LUA_NOREF)
+	{
+		luaL_unref(L, LUA_REGISTRYINDEX, h->refs[EventType]);
+		h->refs[EventType] = LUA_NOREF;
+		h->count -= 1;
+	}
+	if (!lua_isnil(L, idx))
+	{
+		lua_pushvalue(L, idx);
+		h->refs[EventType] = luaL_ref(L, LUA_REGISTRYINDEX);
+		h->count += 1;
+	}
+}
+
+// Removes all event type handlers, everything goes to the callback again
+void callbackClearHandlers(lua_State *L)
+{
+	cbhandlers* h = findHandlers(DSS_getutilid(L));
+	int i;
+
+	if (h == NULL || h->count == 0) return;
+	for (i = 0; i < LPNP_EVENTTYPES; i++)
+	{
+		if (h->refs[i] != LUA_NOREF) luaL_unref(L, LUA_REGISTRYINDEX, h->refs[i]);
+		h->refs[i] = LUA_NOREF;
+	}
+	h->count = 0;
+}
+
+// Resets the delivery options of a Lua state to their defaults, to be
+// called when it stops, as its utilid may be reused by another state.
+void callbackResetOptions(void* utilid)
+{
+	cbhandlers* h = findHandlers(utilid);
+	if (h == NULL) return;
+	h->lazy = FALSE;
+	h->positional = FALSE;
+	h->deadline = 0;
+}
+
+// Sets the deadline in milliseconds for blocking requests to the calling
+// Lua state, 0 to wait indefinitely
+void callbackSetDeadline(lua_State *L, int ms)
+{
+	if (ms < 0) ms = 0;
+	if (ms > LPNP_MAX_DEADLINE) ms = LPNP_MAX_DEADLINE;
+	getHandlers(L)->deadline = ms;
+}
+
+// Returns the deadline in milliseconds for blocking requests to a Lua
+// state, 0 if there is none
+int callbackGetDeadline(void* utilid)
+{
+	cbhandlers* h = findHandlers(utilid);
+	return (h == NULL) ? 0 : h->deadline;
+}
+
+// Returns TRUE if the event type must be delivered to the Lua state
+static int callbackWanted(Upnp_EventType EventType, void* cookie)
+{
+	cbhandlers* h = findHandlers(cookie);
+	return h == NULL || h->count == 0 || h->refs[EventType] != LUA_NOREF;
+}
+
+// Pushes the handler for the event type
+static void pushEventHandler(lua_State *L, Upnp_EventType EventType, void* cookie)
+{
+	cbhandlers* h = findHandlers(cookie);
+	if (h != NULL && h->count != 0 && h->refs[EventType] != LUA_NOREF)
+		lua_rawgeti(L, LUA_REGISTRYINDEX, h->refs[EventType]);
+	else
+		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
+}
+
+// =================== Delivery records ==========================
+// Counts an event that does not reach Lua.
+// Returns 0, the result for the pupnp callback
+static int dropEvent(Upnp_EventType EventType)
+{
+	counterInc(EventType, LPNP_COUNT_DROPPED);
+	return 0;
+}
 
+// Allocates a delivery record for an event that was admitted by queueAdmit()
+// Returns NULL if out of memory, in which case the admission is released.
+static cbdelivery* newDelivery(Upnp_EventType EventType, void* cookie)
+{
+	cbdelivery* mydata = poolNewDelivery();
 	if (mydata == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory allocating 'mydata' for UpnpDiscovery callback.", cookie);
-		return 0;
+		counterInc(EventType, LPNP_COUNT_OOM);
+		dropEvent(EventType);
+		queueRelease(EventType, cookie);
+		return NULL;
 	}
 	mydata->EventType = EventType;
-	if (dEvent != NULL) {	// in case of UPNP_DISCOVERY_SEARCH_TIMEOUT event == NULL
-		mydata->Event =  UpnpDiscovery_dup(dEvent);
-	} else {
-		mydata->Event = NULL;
-	}
 	mydata->Cookie = cookie;
-	if (mydata->Event == NULL && dEvent != NULL)
+	counterEnter(EventType);
+	latencyStart(mydata);
+	return mydata;
+}
+
+// Releases a delivery record, and its admission
+static void releaseDelivery(cbdelivery* mydata)
+{
+	counterLeave(mydata->EventType);
+	queueRelease(mydata->EventType, mydata->Cookie);
+	poolFreeDelivery(mydata);
+}
+
+// Counts the outcome of delivering a blocking request
+static void countRequest(cbdelivery* mydata, int err)
+{
+	if (err != DSS_SUCCESS && err != LPNP_PENDING_EXPIRED) counterInc(mydata->EventType, LPNP_COUNT_DSSERROR);
+	if (err >= DSS_SUCCESS) counterInc(mydata->EventType, LPNP_COUNT_DELIVERED);
+	if (err < DSS_SUCCESS || err == LPNP_PENDING_EXPIRED) dropEvent(mydata->EventType);
+}
+
+// =================== Async delivery ============================
+// The async events (those not requiring an answer from Lua) have their
+// 'Decode' function set in the cbdelivery record. That function pushes
+// the event (if L != NULL) and releases the record. This allows the
+// events to be delivered either one at a time or in a batch.
+// The event data is described by the 'Info' record; the field names and
+// functions to push a single field and to release the data. Depending on
+// the option of the Lua state the event is pushed as a table with all
+// fields, or as a userdata that pushes the fields only when accessed.
+
+// Enables/disables delivery of lazy event objects instead of tables, for
+// the calling Lua state
+void callbackSetLazy(lua_State *L, int enable)
+{
+	getHandlers(L)->lazy = enable;
+}
+
+// Number of fields in a NULL terminated field list
+#define FIELDCOUNT(fields) ((int)(sizeof(fields) / sizeof(fields[0])) - 1)
+
+// Field keys and event names are created once per Lua state and kept in
+// the registry, so building an event table does not have to hash them
+// again. The keys table for an event type is stored under the address of
+// its cbeventinfo record; keys at field index + 1, followed by "Event".
+static void pushEventKeys(lua_State *L, const cbeventinfo* Info)
+{
+	int i;
+	lua_pushlightuserdata(L, (void*)Info);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (lua_istable(L, -1)) return;
+	lua_pop(L, 1);
+	lua_createtable(L, Info->count + 1, 0);
+	for (i = 0; i < Info->count; i++)
 	{
-		deliverUpnpCallbackError("Out of memory duplicating 'event' for UpnpDiscovery callback.", cookie);
-		free(mydata);
-		return 0;
+		lua_pushstring(L, Info->fields[i]);
+		lua_rawseti(L, -2, i + 1);
 	}
+	lua_pushliteral(L, "Event");
+	lua_rawseti(L, -2, Info->count + 1);
+	lua_pushlightuserdata(L, (void*)Info);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, LUA_REGISTRYINDEX);
+}
 
-	err = DSS_deliver(cookie, &decodeUpnpDiscovery, NULL, mydata);
-	if (err != DSS_SUCCESS)
+// The event names, indexed by event type + 1, stored in the registry
+// under the address of 'eventnameskey'
+static char eventnameskey;
+static void pushEventName(lua_State *L, Upnp_EventType EventType)
+{
+	size_t i;
+	lua_pushlightuserdata(L, &eventnameskey);
+	lua_rawget(L, LUA_REGISTRYINDEX);
+	if (!lua_istable(L, -1))
 	{
-		deliverUpnpCallbackError("Error delivering 'event' for UpnpDiscovery callback.", cookie);
-		if (err > DSS_SUCCESS) // it's a warning; in this case data is still delivered and shouldn't be released
+		lua_pop(L, 1);
+		lua_createtable(L, sizeof(EventTypes) / sizeof(EventTypes[0]), 0);
+		for (i = 0; i < sizeof(EventTypes) / sizeof(EventTypes[0]); i++)
 		{
-			UpnpDiscovery_delete((UpnpDiscovery *)mydata->Event);
-			free(mydata);
+			lua_pushstring(L, EventTypes[i].etTypeDesc);
+			lua_rawseti(L, -2, EventTypes[i].et + 1);
 		}
-		return 0;
+		lua_pushlightuserdata(L, &eventnameskey);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, -1, (int)EventType + 1);
+	lua_remove(L, -2);
+	if (lua_isnil(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_pushstring(L, UpnpGetEventType(EventType));
+	}
+}
+
+// Pushes a string if not NULL/empty, returns the number of values pushed
+static int pushstringvalue(lua_State *L, const char* value)
+{
+	if (value == NULL || *value == 0) return 0;
+	lua_pushstring(L, value);
+	return 1;
+}
+static int pushlstringvalue(lua_State *L, const char* value, size_t len)
+{
+	if (len == 0) return 0;
+	lua_pushlstring(L, value, len);
+	return 1;
+}
+static int pushupnpstringvalue(lua_State *L, const UpnpString* value)
+{
+	return pushlstringvalue(L, UpnpString_get_String(value), UpnpString_get_Length(value));
+}
+// Pushes the error code if not UPNP_E_SUCCESS, or the error message (errmsg == TRUE)
+static int pusherrorvalue(lua_State *L, int ErrCode, int errmsg)
+{
+	if (ErrCode == UPNP_E_SUCCESS) return 0;
+	if (errmsg)
+		return pushstringvalue(L, UpnpGetErrorMessage(ErrCode));
+	lua_pushinteger(L, ErrCode);
+	return 1;
+}
+// Pushes the document, ownership passes to the Lua node wrapper
+static int pushdocumentvalue(lua_State *L, IXML_Document** doc)
+{
+	if (*doc == NULL) return 0;
+	pushLuaDocument(L, *doc);
+	*doc = NULL;
+	return 1;
+}
+
+// Pushes the event table with all fields set
+static void pushEventTable(lua_State *L, Upnp_EventType EventType, void* Event, const cbeventinfo* Info)
+{
+	int i;
+	lua_checkstack(L, 5);
+	recyclePushTable(L, 0, Info->count + 1);
+	pushEventKeys(L, Info);
+	lua_rawgeti(L, -1, Info->count + 1);
+	pushEventName(L, EventType);
+	lua_rawset(L, -4);
+	for (i = 0; i < Info->count; i++)
+	{
+		lua_rawgeti(L, -1, i + 1);		// the key
+		if (Info->Field(L, Event, i))
+			lua_rawset(L, -4);
+		else
+			lua_pop(L, 1);
+	}
+	lua_pop(L, 1);	// pop the keys table
+}
+
+// =================== Lazy event objects ========================
+// The userdata owns the event data until collected. Field values are
+// created on each access, except for the userdata values (documents)
+// which are stored in the environment table of the event, as the node
+// wrapper took ownership of the document.
+typedef struct _luaevent {
+	Upnp_EventType EventType;
+	void* Event;				// event data, NULL if released
+	const cbeventinfo* Info;
+	int cached;					// TRUE if the environment table has been set
+} luaevent;
+
+// Pushes a lazy event object, takes ownership of the event data
+static void pushLazyEvent(lua_State *L, Upnp_EventType EventType, void* Event, const cbeventinfo* Info)
+{
+	luaevent* ev = (luaevent*)lua_newuserdata(L, sizeof(luaevent));
+	ev->EventType = EventType;
+	ev->Event = Event;
+	ev->Info = Info;
+	ev->cached = FALSE;
+	luaL_getmetatable(L, LPNP_EVENT_MT);
+	lua_setmetatable(L, -2);
+}
+
+// __index method for the event objects
+int L_EventIndex(lua_State *L)
+{
+	luaevent* ev = (luaevent*)luaL_checkudata(L, 1, LPNP_EVENT_MT);
+	const char* key = lua_tostring(L, 2);
+	int i;
+
+	if (key != NULL && strcmp(key, "Event") == 0)
+	{
+		pushEventName(L, ev->EventType);
+		return 1;
+	}
+	if (key == NULL || ev->Event == NULL)
+	{
+		lua_pushnil(L);
+		return 1;
+	}
+	if (ev->cached)
+	{
+		lua_getfenv(L, 1);
+		lua_getfield(L, -1, key);
+		if (!lua_isnil(L, -1)) return 1;
+		lua_pop(L, 2);
+	}
+	for (i = 0; i < ev->Info->count; i++)
+	{
+		if (strcmp(key, ev->Info->fields[i]) == 0)
+		{
+			if (!ev->Info->Field(L, ev->Event, i)) break;
+			if (lua_type(L, -1) == LUA_TUSERDATA)
+			{
+				// must be kept alive as long as the event
+				if (!ev->cached)
+				{
+					lua_newtable(L);
+					lua_setfenv(L, 1);
+					ev->cached = TRUE;
+				}
+				lua_getfenv(L, 1);
+				lua_pushvalue(L, -2);
+				lua_setfield(L, -2, key);
+				lua_pop(L, 1);
+			}
+			return 1;
+		}
+	}
+	lua_pushnil(L);
+	return 1;
+}
+
+// GC method for the event objects
+int L_DestroyEvent(lua_State *L)
+{
+	luaevent* ev = (luaevent*)lua_touserdata(L, 1);
+	if (ev->Event != NULL)
+	{
+		ev->Info->Free(ev->Event);
+		ev->Event = NULL;
 	}
 	return 0;
 }
 
-// =================== Action Complete events ==========================
-static int decodeUpnpActionComplete(lua_State *L, void* pData, void* utilid)
+// tostring method for the event objects
+int L_eventtostring(lua_State *L)
+{
+	luaevent* ev = (luaevent*)luaL_checkudata(L, 1, LPNP_EVENT_MT);
+	lua_pushfstring(L, "UPnP event: %s", UpnpGetEventType(ev->EventType));
+	return 1;
+}
+
+// Generic decoder for the async events
+static int decodeUpnpAsync(lua_State *L, cbdelivery* mydata)
 {
 	int result = 0;
-	cbdelivery* mydata = (cbdelivery*)pData;
-	UpnpActionComplete* acEvent = (UpnpActionComplete*)mydata->Event;
+	cbhandlers* h;
 
 	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
 	if (L != NULL)
 	{
-		// Push the callback function first
-		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
-		// Create and fill the event table for Lua
-		lua_newtable(L);
-		pushstringfield(L, "Event", UpnpGetEventType(mydata->EventType));
-		if (UpnpActionComplete_get_ErrCode(acEvent) != UPNP_E_SUCCESS)
+		latencyStage(mydata, LPNP_STAGE_QUEUE);
+		h = findHandlers(mydata->Cookie);
+		if (h != NULL && h->lazy)
 		{
-			lua_pushstring(L, "ErrCode");
-			lua_pushinteger(L, UpnpActionComplete_get_ErrCode(acEvent));
-			lua_settable(L, -3);
-			pushstringfield(L, "Error", UpnpGetErrorMessage(UpnpActionComplete_get_ErrCode(acEvent)));
+			pushLazyEvent(L, mydata->EventType, mydata->Event, mydata->Info);
+			mydata->Event = NULL;	// now owned by the userdata
 		}
-		pushstringfield(L, "CtrlUrl", UpnpString_get_String(UpnpActionComplete_get_CtrlUrl(acEvent)));
-		lua_pushstring(L, "ActionRequest");
-		pushLuaDocument(L, UpnpActionComplete_get_ActionRequest(acEvent));
-		lua_settable(L, -3);
-		lua_pushstring(L, "ActionResult");
-		pushLuaDocument(L, UpnpActionComplete_get_ActionResult(acEvent));
-		lua_settable(L, -3);
-		result = 2;	// 2 return arguments, callback + table
+		else
+			pushEventTable(L, mydata->EventType, mydata->Event, mydata->Info);
+		latencyStage(mydata, LPNP_STAGE_DECODE);
+		latencyDone(mydata);
+		counterInc(mydata->EventType, LPNP_COUNT_DECODED);
+		result = 1;	// event pushed
 	}
-	UpnpActionComplete_delete(acEvent);
-	free(mydata);
+	else
+		dropEvent(mydata->EventType);
+	if (mydata->Event != NULL) mydata->Info->Free(mydata->Event);
+	releaseDelivery(mydata);
 	return result;
 }
 
-int deliverUpnpActionComplete(Upnp_EventType EventType, const UpnpActionComplete *acEvent, void* cookie)
+// Decodes a single async event; calls the callback with the event table
+static int decodeUpnpCallback(lua_State *L, void* pData, void* utilid)
 {
-	int err = DSS_SUCCESS;
-	cbdelivery* mydata = (cbdelivery*)malloc(sizeof(cbdelivery));
-	IXML_Document* ActionRequest = NULL;
-	IXML_Document* ActionRequestCopy = NULL;
-	IXML_Document* ActionResult = NULL;
-	IXML_Document* ActionResultCopy = NULL;
+	cbdelivery* mydata = (cbdelivery*)pData;
+
+	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
+	if (L == NULL) return mydata->Decode(NULL, mydata);
 
+	recycleStart(L);	// the previous event table is no longer used
+	// Push the handler function first
+	pushEventHandler(L, mydata->EventType, mydata->Cookie);
+	if (mydata->Decode(L, mydata)) return 2;	// 2 return arguments, callback + table
+	lua_pop(L, 1);
+	return 0;
+}
+
+// Delivers an async event, through the ring or the batch queue if enabled.
+// If not delivered (DSS error, not warning), the record is released.
+static int deliverUpnpCallback(cbdelivery* mydata)
+{
+	Upnp_EventType EventType = mydata->EventType;	// once handed off, the record may be released any time
+	int err = ringDeliver(mydata);
+	if (err == LPNP_RING_FULL)
+	{
+		// dropped, counted in the ring statistics
+		mydata->Decode(NULL, mydata);
+		return DSS_SUCCESS;
+	}
+	if (err == LPNP_RING_DISABLED)
+		err = queueDeliver(mydata);
+	if (err == LPNP_QUEUE_DISABLED)
+		err = DSS_deliver(mydata->Cookie, &decodeUpnpCallback, NULL, mydata);
+	if (err != DSS_SUCCESS) counterInc(EventType, LPNP_COUNT_DSSERROR);
+	if (err < DSS_SUCCESS)
+		mydata->Decode(NULL, mydata);
+	else
+		counterInc(EventType, LPNP_COUNT_DELIVERED);
+	return err;
+}
+
+// =================== Discovery events ==========================
+// Instead of duplicating the entire UpnpDiscovery object, only the fields
+// used by the decoder are packed in a single buffer; the integers, the
+// string lengths and the string bytes (not NULL terminated)
+static const char* discoveryfields[] = { "ErrCode", "Error", "Expires", "DeviceID", "DeviceType",
+	"ServiceType", "ServiceVer", "Location", "Os", "Date", "Ext", NULL };
+#define DISCOVERY_STRINGS 3		// index of the first string field
+#define DISCOVERY_FIELDS 8		// number of string fields
+
+typedef struct _packeddiscovery {
+	int ErrCode;
+	int Expires;
+	size_t size;						// total size of the buffer
+	size_t len[DISCOVERY_FIELDS];		// length of each string
+	char data[1];						// string bytes, allocated beyond struct
+} packeddiscovery;
+
+// Packs the fields of a discovery event, returns NULL if out of memory
+static packeddiscovery* packUpnpDiscovery(const UpnpDiscovery *dEvent)
+{
+	const UpnpString* fields[DISCOVERY_FIELDS];
+	packeddiscovery* packed;
+	size_t size = sizeof(packeddiscovery);
+	char* p;
+	int i;
+
+	fields[0] = UpnpDiscovery_get_DeviceID(dEvent);
+	fields[1] = UpnpDiscovery_get_DeviceType(dEvent);
+	fields[2] = UpnpDiscovery_get_ServiceType(dEvent);
+	fields[3] = UpnpDiscovery_get_ServiceVer(dEvent);
+	fields[4] = UpnpDiscovery_get_Location(dEvent);
+	fields[5] = UpnpDiscovery_get_Os(dEvent);
+	fields[6] = UpnpDiscovery_get_Date(dEvent);
+	fields[7] = UpnpDiscovery_get_Ext(dEvent);
+	for (i = 0; i < DISCOVERY_FIELDS; i++) size += UpnpString_get_Length(fields[i]);
+
+	packed = (packeddiscovery*)poolNewPayload(size);
+	if (packed == NULL) return NULL;
+	packed->ErrCode = UpnpDiscovery_get_ErrCode(dEvent);
+	packed->Expires = UpnpDiscovery_get_Expires(dEvent);
+	packed->size = size;
+	p = packed->data;
+	for (i = 0; i < DISCOVERY_FIELDS; i++)
+	{
+		packed->len[i] = UpnpString_get_Length(fields[i]);
+		memcpy(p, UpnpString_get_String(fields[i]), packed->len[i]);
+		p += packed->len[i];
+	}
+	return packed;
+}
+
+static int fieldUpnpDiscovery(lua_State *L, void* Event, int idx)
+{
+	packeddiscovery* dEvent = (packeddiscovery*)Event;
+	const char* p;
+	int i;
+
+	if (dEvent == NULL) return 0;	// search timeout has no data
+	switch (idx) {
+		case 0: return pusherrorvalue(L, dEvent->ErrCode, FALSE);
+		case 1: return pusherrorvalue(L, dEvent->ErrCode, TRUE);
+		case 2:
+			lua_pushinteger(L, dEvent->Expires);
+			return 1;
+	}
+	// TODO: add address info, check *NIX vs Win32 differences, and IPv4 vs IPv6 (DestAddr)
+	idx = idx - DISCOVERY_STRINGS;
+	p = dEvent->data;
+	for (i = 0; i < idx; i++) p += dEvent->len[i];
+	return pushlstringvalue(L, p, dEvent->len[idx]);
+}
+
+static void freeUpnpDiscovery(void* Event)
+{
+	packeddiscovery* dEvent = (packeddiscovery*)Event;
+	poolFreePayload(dEvent, dEvent->size);
+}
+
+static const cbeventinfo discoveryinfo = { discoveryfields, FIELDCOUNT(discoveryfields), &fieldUpnpDiscovery, &freeUpnpDiscovery };
+
+int deliverUpnpDiscovery(Upnp_EventType EventType, const UpnpDiscovery *dEvent, void* cookie)
+{
+	cbdelivery* mydata;
+
+	if (!callbackWanted(EventType, cookie)) return dropEvent(EventType);		// no handler, dropped
+	if (!dedupCheck(EventType, dEvent, cookie)) return 0;	// repeated advertisement, suppressed
+	if (!queueAdmit(EventType, cookie)) return dropEvent(EventType);	// dropped by queue policy
+	mydata = newDelivery(EventType, cookie);
 	if (mydata == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory allocating 'mydata' for UpnpActionComplete callback.", cookie);
+		errorReport("Out of memory allocating 'mydata' for UpnpDiscovery callback.", cookie);
 		return 0;
 	}
-	ActionRequest = UpnpActionComplete_get_ActionRequest(acEvent);
-	ActionResult = UpnpActionComplete_get_ActionResult(acEvent);
 	mydata->EventType = EventType;
-	mydata->Event =  UpnpActionComplete_dup(acEvent);
+	mydata->Decode = &decodeUpnpAsync;
+	mydata->Info = &discoveryinfo;
+	if (dEvent != NULL) {	// in case of UPNP_DISCOVERY_SEARCH_TIMEOUT event == NULL
+		mydata->Event = packUpnpDiscovery(dEvent);
+	} else {
+		mydata->Event = NULL;
+	}
 	mydata->Cookie = cookie;
-	if (mydata->Event == NULL)
+	if (mydata->Event == NULL && dEvent != NULL)
 	{
-		deliverUpnpCallbackError("Out of memory duplicating 'event' for UpnpActionComplete callback.", cookie);
-		free(mydata);
+		counterInc(EventType, LPNP_COUNT_OOM);
+		dropEvent(EventType);
+		errorReport("Out of memory duplicating 'event' for UpnpDiscovery callback.", cookie);
+		releaseDelivery(mydata);
 		return 0;
 	}
-	ActionRequestCopy = copyIXMLdoc(ActionRequest);
-	ActionResultCopy = copyIXMLdoc(ActionResult);
-	if ((ActionRequest != NULL && ActionRequestCopy == NULL) || (ActionResult != NULL && ActionResultCopy == NULL))
+
+	if (deliverUpnpCallback(mydata) != DSS_SUCCESS)
+		errorReport("Error delivering 'event' for UpnpDiscovery callback.", cookie);
+	return 0;
+}
+
+// =================== Action Complete events ==========================
+// The documents are cloned exactly once, when packing the event. The clones
+// are owned by the packed record until pushed to Lua, from then on they are
+// owned by the Lua node wrapper and freed when it is collected.
+static const char* actioncompletefields[] = { "ErrCode", "Error", "CtrlUrl", "ActionRequest", "ActionResult", NULL };
+
+typedef struct _packedactioncomplete {
+	int ErrCode;
+	size_t size;						// total size of the buffer
+	IXML_Document* ActionRequest;		// cloned document
+	IXML_Document* ActionResult;		// cloned document
+	size_t len;							// length of CtrlUrl
+	char CtrlUrl[1];					// string bytes, allocated beyond struct
+} packedactioncomplete;
+
+// Packs the fields of an action complete event, returns NULL if out of memory
+static packedactioncomplete* packUpnpActionComplete(const UpnpActionComplete *acEvent)
+{
+	const UpnpString* CtrlUrl = UpnpActionComplete_get_CtrlUrl(acEvent);
+	IXML_Document* ActionRequest = UpnpActionComplete_get_ActionRequest(acEvent);
+	IXML_Document* ActionResult = UpnpActionComplete_get_ActionResult(acEvent);
+	size_t len = UpnpString_get_Length(CtrlUrl);
+	packedactioncomplete* packed;
+
+	packed = (packedactioncomplete*)poolNewPayload(sizeof(packedactioncomplete) + len);
+	if (packed == NULL) return NULL;
+	packed->ErrCode = UpnpActionComplete_get_ErrCode(acEvent);
+	packed->size = sizeof(packedactioncomplete) + len;
+	packed->len = len;
+	memcpy(packed->CtrlUrl, UpnpString_get_String(CtrlUrl), len);
+	packed->ActionRequest = copyIXMLdoc(ActionRequest);
+	packed->ActionResult = copyIXMLdoc(ActionResult);
+	if ((ActionRequest != NULL && packed->ActionRequest == NULL) || (ActionResult != NULL && packed->ActionResult == NULL))
 	{
-		deliverUpnpCallbackError("Out of memory duplicating 'event IXMLs' for UpnpActionComplete callback.", cookie);
-		ixmlNode_free((IXML_Node*)ActionRequestCopy);
-		ixmlNode_free((IXML_Node*)ActionResultCopy);
-		UpnpActionComplete_delete((UpnpActionComplete *)mydata->Event);
-		free(mydata);
-		return 0;
+		if (packed->ActionRequest != NULL) ixmlDocument_free(packed->ActionRequest);
+		if (packed->ActionResult != NULL) ixmlDocument_free(packed->ActionResult);
+		poolFreePayload(packed, packed->size);
+		return NULL;
 	}
+	return packed;
+}
+
+static int fieldUpnpActionComplete(lua_State *L, void* Event, int idx)
+{
+	packedactioncomplete* acEvent = (packedactioncomplete*)Event;
+	switch (idx) {
+		case 0: return pusherrorvalue(L, acEvent->ErrCode, FALSE);
+		case 1: return pusherrorvalue(L, acEvent->ErrCode, TRUE);
+		case 2: return pushlstringvalue(L, acEvent->CtrlUrl, acEvent->len);
+		case 3: return pushdocumentvalue(L, &acEvent->ActionRequest);
+		case 4: return pushdocumentvalue(L, &acEvent->ActionResult);
+	}
+	return 0;
+}
 
-	err = DSS_deliver(cookie, &decodeUpnpActionComplete, NULL, mydata);
-	if (err != DSS_SUCCESS)
+// Releases the record, and the documents not handed to Lua
+static void freeUpnpActionComplete(void* Event)
+{
+	packedactioncomplete* acEvent = (packedactioncomplete*)Event;
+	if (acEvent->ActionRequest != NULL) ixmlDocument_free(acEvent->ActionRequest);
+	if (acEvent->ActionResult != NULL) ixmlDocument_free(acEvent->ActionResult);
+	poolFreePayload(acEvent, acEvent->size);
+}
+
+static const cbeventinfo actioncompleteinfo = { actioncompletefields, FIELDCOUNT(actioncompletefields), &fieldUpnpActionComplete, &freeUpnpActionComplete };
+
+int deliverUpnpActionComplete(Upnp_EventType EventType, const UpnpActionComplete *acEvent, void* cookie)
+{
+	cbdelivery* mydata;
+
+	if (!callbackWanted(EventType, cookie)) return dropEvent(EventType);		// no handler, dropped
+	if (!queueAdmit(EventType, cookie)) return dropEvent(EventType);	// dropped by queue policy
+	mydata = newDelivery(EventType, cookie);
+	if (mydata == NULL)
 	{
-		deliverUpnpCallbackError("Error delivering 'event' for UpnpActionComplete callback.", cookie);
-		if (err > DSS_SUCCESS) // it's a warning; in this case data is still delivered and shouldn't be released
-		{
-			ixmlNode_free((IXML_Node*)ActionRequestCopy);
-			ixmlNode_free((IXML_Node*)ActionResultCopy);
-			UpnpActionComplete_delete((UpnpActionComplete *)mydata->Event);
-			free(mydata);
-		}
+		errorReport("Out of memory allocating 'mydata' for UpnpActionComplete callback.", cookie);
 		return 0;
 	}
+	mydata->EventType = EventType;
+	mydata->Decode = &decodeUpnpAsync;
+	mydata->Info = &actioncompleteinfo;
+	mydata->Event = packUpnpActionComplete(acEvent);
+	mydata->Cookie = cookie;
+	if (mydata->Event == NULL)
+	{
+		counterInc(EventType, LPNP_COUNT_OOM);
+		dropEvent(EventType);
+		errorReport("Out of memory duplicating 'event' for UpnpActionComplete callback.", cookie);
+		releaseDelivery(mydata);
+		return 0;
+	}
+
+	// on failure the record (and the document clones) is released by the decoder
+	if (deliverUpnpCallback(mydata) != DSS_SUCCESS)
+		errorReport("Error delivering 'event' for UpnpActionComplete callback.", cookie);
 	return 0;
 }
 
 // =================== StateVar Complete events ==========================
-static int decodeUpnpStateVarComplete(lua_State *L, void* pData, void* utilid)
-{
-	int result = 0;
-	cbdelivery* mydata = (cbdelivery*)pData;
-	UpnpStateVarComplete* svcEvent = (UpnpStateVarComplete*)mydata->Event;
+static const char* statevarcompletefields[] = { "ErrCode", "Error", "CtrlUrl", "StateVarName", "CurrentVal", NULL };
 
-	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
-	if (L != NULL)
-	{
-		// Push the callback function first
-		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
-		// Create and fill the event table for Lua
-		lua_newtable(L);
-		pushstringfield(L, "Event", UpnpGetEventType(mydata->EventType));
-		if (UpnpStateVarComplete_get_ErrCode(svcEvent) != UPNP_E_SUCCESS)
-		{
-			lua_pushstring(L, "ErrCode");
-			lua_pushinteger(L, UpnpStateVarComplete_get_ErrCode(svcEvent));
-			lua_settable(L, -3);
-			pushstringfield(L, "Error", UpnpGetErrorMessage(UpnpStateVarComplete_get_ErrCode(svcEvent)));
-		}
-		pushstringfield(L, "CtrlUrl", UpnpString_get_String(UpnpStateVarComplete_get_CtrlUrl(svcEvent)));
-		pushstringfield(L, "StateVarName", UpnpString_get_String(UpnpStateVarComplete_get_StateVarName(svcEvent)));
-		pushstringfield(L, "CurrentVal", UpnpStateVarComplete_get_CurrentVal(svcEvent));
-		result = 2;	// 2 return arguments, callback + table
+static int fieldUpnpStateVarComplete(lua_State *L, void* Event, int idx)
+{
+	UpnpStateVarComplete* svcEvent = (UpnpStateVarComplete*)Event;
+	switch (idx) {
+		case 0: return pusherrorvalue(L, UpnpStateVarComplete_get_ErrCode(svcEvent), FALSE);
+		case 1: return pusherrorvalue(L, UpnpStateVarComplete_get_ErrCode(svcEvent), TRUE);
+		case 2: return pushupnpstringvalue(L, UpnpStateVarComplete_get_CtrlUrl(svcEvent));
+		case 3: return pushupnpstringvalue(L, UpnpStateVarComplete_get_StateVarName(svcEvent));
+		case 4: return pushstringvalue(L, UpnpStateVarComplete_get_CurrentVal(svcEvent));
 	}
-	UpnpStateVarComplete_delete(svcEvent);
-	free(mydata);
-	return result;
+	return 0;
+}
+
+static void freeUpnpStateVarComplete(void* Event)
+{
+	UpnpStateVarComplete_delete((UpnpStateVarComplete*)Event);
 }
 
+static const cbeventinfo statevarcompleteinfo = { statevarcompletefields, FIELDCOUNT(statevarcompletefields), &fieldUpnpStateVarComplete, &freeUpnpStateVarComplete };
+
 int deliverUpnpStateVarComplete(Upnp_EventType EventType, const UpnpStateVarComplete *svcEvent, void* cookie)
 {
-	int err = DSS_SUCCESS;
-	cbdelivery* mydata = (cbdelivery*)malloc(sizeof(cbdelivery));
+	cbdelivery* mydata;
 
+	if (!callbackWanted(EventType, cookie)) return dropEvent(EventType);		// no handler, dropped
+	if (!queueAdmit(EventType, cookie)) return dropEvent(EventType);	// dropped by queue policy
+	mydata = newDelivery(EventType, cookie);
 	if (mydata == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory allocating 'mydata' for UpnpStateVarComplete callback.", cookie);
+		errorReport("Out of memory allocating 'mydata' for UpnpStateVarComplete callback.", cookie);
 		return 0;
 	}
 	mydata->EventType = EventType;
+	mydata->Decode = &decodeUpnpAsync;
+	mydata->Info = &statevarcompleteinfo;
 	mydata->Event =  UpnpStateVarComplete_dup(svcEvent);
 	mydata->Cookie = cookie;
 	if (mydata->Event == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory duplicating 'event' for UpnpStateVarComplete callback.", cookie);
-		free(mydata);
+		counterInc(EventType, LPNP_COUNT_OOM);
+		dropEvent(EventType);
+		errorReport("Out of memory duplicating 'event' for UpnpStateVarComplete callback.", cookie);
+		releaseDelivery(mydata);
 		return 0;
 	}
 
-	err = DSS_deliver(cookie, &decodeUpnpStateVarComplete, NULL, mydata);
-	if (err != DSS_SUCCESS)
-	{
-		deliverUpnpCallbackError("Error delivering 'event' for UpnpStateVarComplete callback.", cookie);
-		if (err > DSS_SUCCESS) // it's a warning; in this case data is still delivered and shouldn't be released
-		{
-			UpnpStateVarComplete_delete((UpnpStateVarComplete *)mydata->Event);
-			free(mydata);
-		}
-		return 0;
-	}
+	if (deliverUpnpCallback(mydata) != DSS_SUCCESS)
+		errorReport("Error delivering 'event' for UpnpStateVarComplete callback.", cookie);
 	return 0;
 }
 
 // =================== Event events ==========================
-static int decodeUpnpEvent(lua_State *L, void* pData, void* utilid)
+// Packed like the action complete events, the ChangedVariables document is
+// cloned once and handed over to Lua by the decoder.
+static const char* eventfields[] = { "EventKey", "ChangedVariables", "SID", NULL };
+
+typedef struct _packedevent {
+	int EventKey;
+	size_t size;						// total size of the buffer
+	IXML_Document* ChangedVariables;	// cloned document
+	size_t len;							// length of SID
+	char SID[1];						// string bytes, allocated beyond struct
+} packedevent;
+
+// Packs the fields of an event, returns NULL if out of memory
+static packedevent* packUpnpEvent(const UpnpEvent *eEvent)
 {
-	int result = 0;
-	cbdelivery* mydata = (cbdelivery*)pData;
-	UpnpEvent* eEvent = (UpnpEvent*)mydata->Event;
+	const UpnpString* SID = UpnpEvent_get_SID(eEvent);
+	IXML_Document* ChangedVariables = UpnpEvent_get_ChangedVariables(eEvent);
+	size_t len = UpnpString_get_Length(SID);
+	packedevent* packed;
 
-	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
-	if (L != NULL)
+	packed = (packedevent*)poolNewPayload(sizeof(packedevent) + len);
+	if (packed == NULL) return NULL;
+	packed->EventKey = UpnpEvent_get_EventKey(eEvent);
+	packed->size = sizeof(packedevent) + len;
+	packed->len = len;
+	memcpy(packed->SID, UpnpString_get_String(SID), len);
+	packed->ChangedVariables = copyIXMLdoc(ChangedVariables);
+	if (ChangedVariables != NULL && packed->ChangedVariables == NULL)
 	{
-		// Push the callback function first
-		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
-		// Create and fill the event table for Lua
-		lua_newtable(L);
-		pushstringfield(L, "Event", UpnpGetEventType(mydata->EventType));
-		lua_pushstring(L, "EventKey");
-		lua_pushinteger(L, UpnpEvent_get_EventKey(eEvent));
-		lua_settable(L, -3);
-		lua_pushstring(L, "ChangedVariables");
-		pushLuaDocument(L, UpnpEvent_get_ChangedVariables(eEvent));
-		lua_settable(L, -3);
-		pushstringfield(L, "SID", UpnpString_get_String(UpnpEvent_get_SID(eEvent)));
-		result = 2;	// 2 return arguments, callback + table
+		poolFreePayload(packed, packed->size);
+		return NULL;
 	}
-	UpnpEvent_delete(eEvent);
-	free(mydata);
-	return result;
+	return packed;
+}
+
+static int fieldUpnpEvent(lua_State *L, void* Event, int idx)
+{
+	packedevent* eEvent = (packedevent*)Event;
+	switch (idx) {
+		case 0:
+			lua_pushinteger(L, eEvent->EventKey);
+			return 1;
+		case 1: return pushdocumentvalue(L, &eEvent->ChangedVariables);
+		case 2: return pushlstringvalue(L, eEvent->SID, eEvent->len);
+	}
+	return 0;
 }
 
+// Releases the record, and the document if not handed to Lua
+static void freeUpnpEvent(void* Event)
+{
+	packedevent* eEvent = (packedevent*)Event;
+	if (eEvent->ChangedVariables != NULL) ixmlDocument_free(eEvent->ChangedVariables);
+	poolFreePayload(eEvent, eEvent->size);
+}
+
+static const cbeventinfo eventinfo = { eventfields, FIELDCOUNT(eventfields), &fieldUpnpEvent, &freeUpnpEvent };
+
 int deliverUpnpEvent(Upnp_EventType EventType, const UpnpEvent *eEvent, void* cookie)
 {
-	int err = DSS_SUCCESS;
-	cbdelivery* mydata = (cbdelivery*)malloc(sizeof(cbdelivery));
-	IXML_Document* ChangedVariables;
-	IXML_Document* ChangedVariablesCopy;
+	cbdelivery* mydata;
 
+	if (!callbackWanted(EventType, cookie)) return dropEvent(EventType);		// no handler, dropped
+	if (!queueAdmit(EventType, cookie)) return dropEvent(EventType);	// dropped by queue policy
+	mydata = newDelivery(EventType, cookie);
 	if (mydata == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory allocating 'mydata' for UpnpEvent callback.", cookie);
+		errorReport("Out of memory allocating 'mydata' for UpnpEvent callback.", cookie);
 		return 0;
 	}
-	ChangedVariables = UpnpEvent_get_ChangedVariables(eEvent);
 	mydata->EventType = EventType;
-	mydata->Event =  UpnpEvent_dup(eEvent);
+	mydata->Decode = &decodeUpnpAsync;
+	mydata->Info = &eventinfo;
+	mydata->Event = packUpnpEvent(eEvent);
 	mydata->Cookie = cookie;
 	if (mydata->Event == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory duplicating 'event' for UpnpEvent callback.", cookie);
-		free(mydata);
-		return 0;
-	}
-	ChangedVariablesCopy = copyIXMLdoc(ChangedVariables);
-	if (ChangedVariables != NULL && ChangedVariablesCopy == NULL)
-	{
-		ixmlNode_free((IXML_Node*)ChangedVariablesCopy);
-		deliverUpnpCallbackError("Out of memory duplicating 'event IXMLs' for UpnpEvent callback.", cookie);
-		UpnpEvent_delete((UpnpEvent *)mydata->Event);
-		free(mydata);
+		counterInc(EventType, LPNP_COUNT_OOM);
+		dropEvent(EventType);
+		errorReport("Out of memory duplicating 'event' for UpnpEvent callback.", cookie);
+		releaseDelivery(mydata);
 		return 0;
 	}
 
-	err = DSS_deliver(cookie, &decodeUpnpEvent, NULL, mydata);
-	if (err != DSS_SUCCESS)
-	{
-		deliverUpnpCallbackError("Error delivering 'event' for UpnpEvent callback.", cookie);
-		if (err > DSS_SUCCESS) // it's a warning; in this case data is still delivered and shouldn't be released
-		{
-			ixmlNode_free((IXML_Node*)ChangedVariablesCopy);
-			UpnpEvent_delete((UpnpEvent *)mydata->Event);
-			free(mydata);
-		}
-		return 0;
-	}
+	// on failure the record (and the document clone) is released by the decoder
+	if (deliverUpnpCallback(mydata) != DSS_SUCCESS)
+		errorReport("Error delivering 'event' for UpnpEvent callback.", cookie);
 	return 0;
 }
 
 // =================== Event Subscribe events ==========================
-static int decodeUpnpEventSubscribe(lua_State *L, void* pData, void* utilid)
-{
-	int result = 0;
-	cbdelivery* mydata = (cbdelivery*)pData;
-	UpnpEventSubscribe* esEvent = (UpnpEventSubscribe*)mydata->Event;
+static const char* eventsubscribefields[] = { "ErrCode", "Error", "TimeOut", "SID", "PublisherUrl", NULL };
 
-	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
-	if (L != NULL)
-	{
-		// Push the callback function first
-		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
-		// Create and fill the event table for Lua
-		lua_newtable(L);
-		pushstringfield(L, "Event", UpnpGetEventType(mydata->EventType));
-		if (UpnpEventSubscribe_get_ErrCode(esEvent) != UPNP_E_SUCCESS)
-		{
-			lua_pushstring(L, "ErrCode");
-			lua_pushinteger(L, UpnpEventSubscribe_get_ErrCode(esEvent));
-			lua_settable(L, -3);
-			pushstringfield(L, "Error", UpnpGetErrorMessage(UpnpEventSubscribe_get_ErrCode(esEvent)));
-		}
-		lua_pushstring(L, "TimeOut");
-		lua_pushinteger(L, UpnpEventSubscribe_get_TimeOut(esEvent));
-		lua_settable(L, -3);
-		pushstringfield(L, "SID", UpnpString_get_String(UpnpEventSubscribe_get_SID(esEvent)));
-		pushstringfield(L, "PublisherUrl", UpnpString_get_String(UpnpEventSubscribe_get_PublisherUrl(esEvent)));
-		result = 2;	// 2 return arguments, callback + table
+static int fieldUpnpEventSubscribe(lua_State *L, void* Event, int idx)
+{
+	UpnpEventSubscribe* esEvent = (UpnpEventSubscribe*)Event;
+	switch (idx) {
+		case 0: return pusherrorvalue(L, UpnpEventSubscribe_get_ErrCode(esEvent), FALSE);
+		case 1: return pusherrorvalue(L, UpnpEventSubscribe_get_ErrCode(esEvent), TRUE);
+		case 2:
+			lua_pushinteger(L, UpnpEventSubscribe_get_TimeOut(esEvent));
+			return 1;
+		case 3: return pushupnpstringvalue(L, UpnpEventSubscribe_get_SID(esEvent));
+		case 4: return pushupnpstringvalue(L, UpnpEventSubscribe_get_PublisherUrl(esEvent));
 	}
-	UpnpEventSubscribe_delete(esEvent);
-	free(mydata);
-	return result;
+	return 0;
 }
 
+static void freeUpnpEventSubscribe(void* Event)
+{
+	UpnpEventSubscribe_delete((UpnpEventSubscribe*)Event);
+}
+
+static const cbeventinfo eventsubscribeinfo = { eventsubscribefields, FIELDCOUNT(eventsubscribefields), &fieldUpnpEventSubscribe, &freeUpnpEventSubscribe };
+
 int deliverUpnpEventSubscribe(Upnp_EventType EventType, const UpnpEventSubscribe *esEvent, void* cookie)
 {
-	int err = DSS_SUCCESS;
-	cbdelivery* mydata = (cbdelivery*)malloc(sizeof(cbdelivery));
+	cbdelivery* mydata;
 
+	if (!callbackWanted(EventType, cookie)) return dropEvent(EventType);		// no handler, dropped
+	if (!queueAdmit(EventType, cookie)) return dropEvent(EventType);	// dropped by queue policy
+	mydata = newDelivery(EventType, cookie);
 	if (mydata == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory allocating 'mydata' for UpnpEventSubscribe callback.", cookie);
+		errorReport("Out of memory allocating 'mydata' for UpnpEventSubscribe callback.", cookie);
 		return 0;
 	}
 	mydata->EventType = EventType;
+	mydata->Decode = &decodeUpnpAsync;
+	mydata->Info = &eventsubscribeinfo;
 	mydata->Event =  UpnpEventSubscribe_dup(esEvent);
 	mydata->Cookie = cookie;
 	if (mydata->Event == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory duplicating 'event' for UpnpEventSubscribe callback.", cookie);
-		free(mydata);
+		counterInc(EventType, LPNP_COUNT_OOM);
+		dropEvent(EventType);
+		errorReport("Out of memory duplicating 'event' for UpnpEventSubscribe callback.", cookie);
+		releaseDelivery(mydata);
 		return 0;
 	}
 
-	err = DSS_deliver(cookie, &decodeUpnpEventSubscribe, NULL, mydata);
-	if (err != DSS_SUCCESS)
-	{
-		deliverUpnpCallbackError("Error delivering 'event' for UpnpEventSubscribe callback.", cookie);
-		if (err > DSS_SUCCESS) // it's a warning; in this case data is still delivered and shouldn't be released
-		{
-			UpnpEventSubscribe_delete((UpnpEventSubscribe *)mydata->Event);
-			free(mydata);
-		}
-		return 0;
-	}
+	if (deliverUpnpCallback(mydata) != DSS_SUCCESS)
+		errorReport("Error delivering 'event' for UpnpEventSubscribe callback.", cookie);
 	return 0;
 }
 
@@ -432,18 +949,21 @@ static int decodeUpnpSubscriptionRequest(lua_State *L, void* pData, void* utilid
 	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
 	if (L != NULL)
 	{
-		// Push the callback function first
-		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
+		latencyStage(mydata, LPNP_STAGE_QUEUE);
+		// Push the handler function first
+		pushEventHandler(L, mydata->EventType, mydata->Cookie);
 		// Create and fill the event table for Lua
-		lua_newtable(L);
+		lua_createtable(L, 0, 4);
 		pushstringfield(L, "Event", UpnpGetEventType(mydata->EventType));
 		pushstringfield(L, "ServiceID", UpnpString_get_String(UpnpSubscriptionRequest_get_ServiceId(srEvent)));
 		pushstringfield(L, "UDN", UpnpString_get_String(UpnpSubscriptionRequest_get_UDN(srEvent)));
 		pushstringfield(L, "SID", UpnpString_get_String(UpnpSubscriptionRequest_get_SID(srEvent)));
+		latencyStage(mydata, LPNP_STAGE_DECODE);
+		counterInc(mydata->EventType, LPNP_COUNT_DECODED);
 		result = 2;	// 2 return arguments, callback + table
 	}
 	//UpnpSubscriptionRequest_delete(srEvent);  do not release resources, the 'return' call still needs them
-	//free(mydata);
+	//releaseDelivery(mydata);
 	return result;
 }
 
@@ -457,22 +977,21 @@ static int decodeUpnpSubscriptionRequest(lua_State *L, void* pData, void* utilid
 static int returnUpnpSubscriptionRequest(lua_State *L, void* pData, void* utilid, int garbage)
 {
 	int err = 0;
-	int i = 1;
 	cbdelivery* mydata = (cbdelivery*)pData;
-	UpnpSubscriptionRequest* srEvent = (UpnpSubscriptionRequest*)mydata->Event;
 	IXML_Document* VarList = NULL;
-	const char* varName = NULL;
-	const char* varValue = NULL;
+	xmlbuffer b;
 
 	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
 	if (L == NULL)
 	{
-		if (garbage) deliverUpnpCallbackError("Error: a UpnpSubscriptionRequest was left unanswered and was garbage collected.", NULL);
+		counterInc(mydata->EventType, LPNP_COUNT_CANCELLED);
+		if (garbage) errorReport("Error: a UpnpSubscriptionRequest was left unanswered and was garbage collected.", mydata->Cookie);
 		return 0;
 	}
 	else
 	{
 		if (garbage) return 0;	// exit, calling thread will cleanup ('deliver' function)
+		latencyStage(mydata, LPNP_STAGE_LUA);
 		if (lua_gettop(L) == 1) lua_newtable(L);	// push an empty table as second argument
 		if (lua_gettop(L) == 2) lua_newtable(L);	// push an empty table as third argument
 		if (lua_gettop(L) < 3 || getdevice(L,1) == -1 || !lua_istable(L,2) || !lua_istable(L,3))
@@ -483,41 +1002,18 @@ static int returnUpnpSubscriptionRequest(lua_State *L, void* pData, void* utilid
 		}
 
 		lua_settop(L,3);	// clear remainder of stack
-		lua_checkstack(L, 7);
-		// iterate over provided table
-		while (1)
+		// serialize the provided tables into a property set, and parse it once
+		xmlInit(&b, 256);
+		xmlStartPropertySet(&b);
+		xmlAddLuaArrays(L, &b, 2, 3, TRUE);
+		xmlEndPropertySet(&b);
+		err = xmlParse(&b, &VarList);
+		if (err != UPNP_E_SUCCESS)
 		{
-			lua_pushinteger(L, i);
-			lua_gettable(L,2);		// get the varname at pos 4
-			if (lua_isnil(L,-1))
-			{
-				// we've reached the end, exit
-				lua_settop(L, 3);
-				if (VarList == NULL)
-				{
-					// no return arguments, so try create an empty list
-					UpnpAddToPropertySet(&VarList, NULL, NULL);
-				}
-				break;
-
-			}
-			lua_pushinteger(L, i);
-			lua_gettable(L,3);		// get the varvalue at pos 5
-			lua_pushvalue(L, 4);	// duplicate the name, at pos 6
-			lua_pushvalue(L, 5);    // duplicate the value, at pos 7
-			varName = lua_tolstring(L, 6, NULL);
-			varValue = lua_tolstring(L, 7, NULL);
-			err = UpnpAddToPropertySet(&VarList, varName, varValue);
-			lua_settop(L,3);	// remove all values added
-			if (err != UPNP_E_SUCCESS)
-			{
-				// error with the table contents, invalid
-				if (VarList != NULL) ixmlDocument_free(VarList);
-				lua_pushnil(L);
-				lua_pushstring(L, "Error: Invalid data in StateVariable tables provided to SubscriptionRequest");
-				return 2;
-			}
-			i += 1;
+			// error with the table contents, invalid
+			lua_pushnil(L);
+			lua_pushstring(L, "Error: Invalid data in StateVariable tables provided to SubscriptionRequest");
+			return 2;
 		}
 		//succeeded, store results
 		mydata->handle = getdevice(L,1);  // TODO: check on error returned and handle it properly
@@ -531,11 +1027,15 @@ static int returnUpnpSubscriptionRequest(lua_State *L, void* pData, void* utilid
 int deliverUpnpSubscriptionRequest(Upnp_EventType EventType, const UpnpSubscriptionRequest *srEvent, void* cookie)
 {
 	int err = DSS_SUCCESS;
-	cbdelivery* mydata = (cbdelivery*)malloc(sizeof(cbdelivery));
+	cbdelivery* mydata;
 
+	if (storeAcceptSubscription(srEvent)) return 0;	// accepted from the state store
+	if (!callbackWanted(EventType, cookie)) return dropEvent(EventType);		// no handler, subscription is not accepted
+	if (!queueAdmit(EventType, cookie)) return dropEvent(EventType);	// dropped by queue policy, subscription is not accepted
+	mydata = newDelivery(EventType, cookie);
 	if (mydata == NULL)
 	{
-		deliverUpnpCallbackError("Out of memory allocating 'mydata' for UpnpSubscriptionRequest callback.", cookie);
+		errorReport("Out of memory allocating 'mydata' for UpnpSubscriptionRequest callback.", cookie);
 		return 0;
 	}
 	mydata->EventType = EventType;
@@ -544,11 +1044,14 @@ int deliverUpnpSubscriptionRequest(Upnp_EventType EventType, const UpnpSubscript
 	mydata->Extra = NULL;
 	mydata->handle = -1;
 
-	// This call will block until all callbacks have been completed
-	err = DSS_deliver(cookie, &decodeUpnpSubscriptionRequest, &returnUpnpSubscriptionRequest, mydata);
+	// This call will block until all callbacks have been completed, or the deadline passed
+	err = pendingDeliver(mydata, callbackGetDeadline(cookie), &decodeUpnpSubscriptionRequest, &returnUpnpSubscriptionRequest);
+	latencyStage(mydata, LPNP_STAGE_RETURN);
+	countRequest(mydata, err);
 
-	// report error if any
-	if (err != DSS_SUCCESS)	deliverUpnpCallbackError("Error delivering 'event' for UpnpSubscriptionRequest callback.", cookie);
+	// report error if any, on expiry 'Extra' is still NULL, so it is not accepted
+	if (err == LPNP_PENDING_EXPIRED) errorReport("Deadline expired for UpnpSubscriptionRequest callback, subscription not accepted.", cookie);
+	else if (err != DSS_SUCCESS)	errorReport("Error delivering 'event' for UpnpSubscriptionRequest callback.", cookie);
 	
 	// Actually handle the subscription
 	if (mydata->Extra != NULL) 
@@ -564,7 +1067,8 @@ int deliverUpnpSubscriptionRequest(Upnp_EventType EventType, const UpnpSubscript
 		ixmlDocument_free((IXML_Document*)mydata->Extra);
 	}
 
-	free(mydata);
+	latencyDone(mydata);
+	releaseDelivery(mydata);
 	return 0;
 }
 
@@ -580,21 +1084,227 @@ int deliverUpnpStateVarRequest(Upnp_EventType EventType, const UpnpStateVarReque
 }
 
 // =================== Action request events ==========================
+// Depending on the option of the Lua state the action arguments are pushed
+// as a 'Params' table keyed by their names, or as 2 arrays in document
+// order; 'ParamNames' with the lowercased names and 'ParamValues' with the
+// values.
+
+// Enables/disables positional arguments for the calling Lua state
+void callbackSetPositional(lua_State *L, int enable)
+{
+	getHandlers(L)->positional = enable;
+}
+
+// Pushes the value of an argument element; the text if it is a plain
+// text element, the IXML node otherwise
+static void pushParamValue(lua_State *L, IXML_Node* node)
+{
+	IXML_Node* child = ixmlNode_getFirstChild(node);
+
+	while (child != NULL && ixmlNode_getNodeType(child) != eTEXT_NODE)
+		child = ixmlNode_getNextSibling(child);
+	if (!ixmlNode_hasAttributes(node) && child != NULL)
+	{
+		// element just has a textnode, no attributes, so add text
+		lua_pushstring(L, ixmlNode_getNodeValue(child));
+	}
+	else
+	{
+		// its more complex, so add the IXML node
+		pushLuaNode(L, node);
+	}
+}
+
+// Pushes a string in lowercase
+static void pushlowerstring(lua_State *L, const char* str)
+{
+	luaL_Buffer b;
+
+	luaL_buffinit(L, &b);
+	while (*str != '\0')
+	{
+		luaL_addchar(&b, (char)tolower((unsigned char)*str));
+		str++;
+	}
+	luaL_pushresult(&b);
+}
+
+// Adds the argument fields to the event table on top of the stack
+static void pushActionParams(lua_State *L, IXML_Node* first, int positional)
+{
+	IXML_Node* node;
+	int count = 0;
+	int i;
+
+	for (node = first; node != NULL; node = ixmlNode_getNextSibling(node)) count++;
+	if (count == 0) return;
+
+	if (positional)
+	{
+		lua_pushstring(L, "ParamNames");
+		lua_createtable(L, count, 0);
+		lua_pushstring(L, "ParamValues");
+		lua_createtable(L, count, 0);
+		for (node = first, i = 1; node != NULL; node = ixmlNode_getNextSibling(node), i++)
+		{
+			pushlowerstring(L, ixmlNode_getNodeName(node));
+			lua_rawseti(L, -4, i);
+			pushParamValue(L, node);
+			lua_rawseti(L, -2, i);
+		}
+		// stack: event, "ParamNames", names, "ParamValues", values
+		lua_rawset(L, -5);
+		lua_rawset(L, -3);
+	}
+	else
+	{
+		lua_pushstring(L, "Params");
+		lua_createtable(L, 0, count);
+		for (node = first; node != NULL; node = ixmlNode_getNextSibling(node))
+		{
+			lua_pushstring(L, ixmlNode_getNodeName(node));
+			pushParamValue(L, node);
+			lua_rawset(L, -3);
+		}
+		lua_rawset(L, -3);
+	}
+}
+
+// The documents of an action request (ActionRequest, ActionResult and
+// SoapHeader) are rarely used, as the parameters are extracted already.
+// So they are only wrapped for Lua when the field is first accessed,
+// through the __index method of the event table. The request is only
+// valid while the pupnp thread is waiting in the 'deliver' function, which
+// keeps a record in the list of live requests. The table only holds a
+// serial number, so a late access finds nothing and returns nil.
+// With a deadline the request may expire while the Lua handler is still
+// running, so Lua then gets clones of the documents, which it owns.
+typedef struct _cbaction {
+	UpnpActionRequest* arEvent;
+	unsigned long serial;
+	int detached;		// TRUE if Lua gets clones of the documents
+	struct _cbaction* next;
+} cbaction;
+
+static cbaction* actionlist = NULL;
+static unsigned long actionserial = 0;
+static char actionserialkey;		// address is the key for the serial in the event table
+
+// Adds a request to the live list
+static void actionStart(cbaction* action, UpnpActionRequest* arEvent, int detached)
+{
+	action->arEvent = arEvent;
+	action->detached = detached;
+	ithread_mutex_lock(&actionlock);
+	actionserial++;
+	if (actionserial == 0) actionserial++;	// 0 is not used
+	action->serial = actionserial;
+	action->next = actionlist;
+	actionlist = action;
+	ithread_mutex_unlock(&actionlock);
+}
+
+// Removes a request from the live list, no document wrappers will be
+// created afterwards
+static void actionDone(cbaction* action)
+{
+	cbaction** link;
+	ithread_mutex_lock(&actionlock);
+	for (link = &actionlist; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == action)
+		{
+			*link = action->next;
+			break;
+		}
+	}
+	ithread_mutex_unlock(&actionlock);
+}
+
+// Wraps the document (lightuserdata) at index 1, called protected
+static int pushActionDocument(lua_State *L)
+{
+	pushLuaDocument(L, (IXML_Document*)lua_touserdata(L, 1));
+	return 1;
+}
+
+// __index method of the action request event table
+int L_ActionRequestIndex(lua_State *L)
+{
+	const char* key = lua_tostring(L, 2);
+	IXML_Document* doc = NULL;
+	unsigned long serial;
+	cbaction* action;
+	int err;
+
+	if (key == NULL) return 0;
+	lua_pushlightuserdata(L, &actionserialkey);
+	lua_rawget(L, 1);
+	serial = (unsigned long)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	if (serial == 0) return 0;
+
+	// push the function first, the lock must not be held on a Lua error
+	lua_checkstack(L, 3);
+	lua_pushcfunction(L, &pushActionDocument);
+	ithread_mutex_lock(&actionlock);
+	for (action = actionlist; action != NULL && action->serial != serial; action = action->next) ;
+	if (action != NULL)
+	{
+		if (strcmp(key, "ActionRequest") == 0)
+			doc = UpnpActionRequest_get_ActionRequest(action->arEvent);
+		else if (strcmp(key, "ActionResult") == 0)
+			doc = UpnpActionRequest_get_ActionResult(action->arEvent);
+		else if (strcmp(key, "SoapHeader") == 0)
+			doc = UpnpActionRequest_get_SoapHeader(action->arEvent);
+		// a detached request may expire while Lua uses the document, so hand out a clone
+		if (doc != NULL && action->detached) doc = copyIXMLdoc(doc);
+	}
+	if (doc == NULL)
+	{
+		ithread_mutex_unlock(&actionlock);
+		return 0;
+	}
+	// wrap while locked, so the 'deliver' function clears it afterwards (if not a clone)
+	lua_pushlightuserdata(L, doc);
+	err = lua_pcall(L, 1, 1, 0);
+	ithread_mutex_unlock(&actionlock);
+	if (err != 0) lua_error(L);
+	// store it, so __index is not called again
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 1);
+	return 1;
+}
+
 static int decodeUpnpActionRequest(lua_State *L, void* pData, void* utilid)
 {
 	int result = 0;
 	cbdelivery* mydata = (cbdelivery*)pData;
 	UpnpActionRequest* arEvent = (UpnpActionRequest*)mydata->Event;
-	IXML_Node* node = NULL;
-	IXML_Node* child = NULL;
+	cbaction* action = (cbaction*)mydata->Extra;
+	IXML_Document* request;
+	cbhandlers* h;
 
 	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
 	if (L != NULL)
 	{
-		// Push the callback function first
-		lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
+		latencyStage(mydata, LPNP_STAGE_QUEUE);
+		request = UpnpActionRequest_get_ActionRequest(arEvent);
+		if (request != NULL && action->detached)
+		{
+			// the parameters refer into the document, so Lua must own it
+			request = copyIXMLdoc(request);
+			if (request == NULL)
+			{
+				errorReport("Out of memory duplicating 'ActionRequest' for UpnpActionRequest callback.", mydata->Cookie);
+				return 0;	// request fails with 'Action Failed'
+			}
+		}
+		// Push the handler function first
+		pushEventHandler(L, mydata->EventType, mydata->Cookie);
 		// Create and fill the event table for Lua
-		lua_newtable(L);
+		lua_createtable(L, 0, 11);
 		pushstringfield(L, "Event", UpnpGetEventType(mydata->EventType));
 		if (UpnpActionRequest_get_ErrCode(arEvent) != UPNP_E_SUCCESS)
 		{
@@ -611,56 +1321,34 @@ static int decodeUpnpActionRequest(lua_State *L, void* pData, void* utilid)
 		pushstringfield(L, "UDN", UpnpString_get_String(UpnpActionRequest_get_DevUDN(arEvent)));
 		pushstringfield(L, "ServiceID", UpnpString_get_String(UpnpActionRequest_get_ServiceID(arEvent)));
 		pushstringfield(L, "ActionName", UpnpString_get_String(UpnpActionRequest_get_ActionName(arEvent)));
-		lua_pushstring(L, "ActionRequest");
-		pushLuaDocument(L, UpnpActionRequest_get_ActionRequest(arEvent));
-		lua_settable(L, -3);
-		lua_pushstring(L, "ActionResult");
-		pushLuaDocument(L, UpnpActionRequest_get_ActionResult(arEvent));
-		lua_settable(L, -3);
-		lua_pushstring(L, "SoapHeader");
-		pushLuaDocument(L, UpnpActionRequest_get_SoapHeader(arEvent));
-		lua_settable(L, -3);
-		// as a bonus add the parameter values keyed by their names
-		// Get the child (first parameter) of the child (Action element) of the document (actionrequest)
-		node = ixmlNode_getFirstChild(ixmlNode_getFirstChild((IXML_Node*)UpnpActionRequest_get_ActionRequest(arEvent)));
-		if (node != NULL) {
-			// we've got at least 1 parameter
-			lua_pushstring(L, "Params");
-			lua_newtable(L);
-			while (node != NULL)
-			{
-				// store param name
-				lua_pushstring(L, ixmlNode_getNodeName(node));
-				// go look for value
-				child = ixmlNode_getFirstChild(node);
-				while (child != NULL && ixmlNode_getNodeType(child) != eTEXT_NODE)
-					child = ixmlNode_getNextSibling(child);
-				if (!ixmlNode_hasAttributes(node) && child != NULL)
-				{
-					// element just has a textnode, no attributes, so add text
-					lua_pushstring(L, ixmlNode_getNodeValue(child));
-				}
-				else
-				{
-					// its more complex, so add the IXML node
-					pushLuaNode(L, node);
-				}
-				// push value in param table and commence with next
-				lua_settable(L, -3);
-				node = ixmlNode_getNextSibling(node);
-			}
-			// param table was filled, now store it
-			lua_settable(L, -3);
+		// the documents are wrapped on first access, see L_ActionRequestIndex
+		lua_pushlightuserdata(L, &actionserialkey);
+		lua_pushnumber(L, (lua_Number)action->serial);
+		lua_rawset(L, -3);
+		if (action->detached && request != NULL)
+		{
+			// the clone is owned by Lua, the table keeps it alive for the parameters
+			lua_pushstring(L, "ActionRequest");
+			pushLuaDocument(L, request);
+			lua_rawset(L, -3);
 		}
+		luaL_getmetatable(L, LPNP_ACTIONREQUEST_MT);
+		lua_setmetatable(L, -2);
+		// as a bonus add the parameter values, keyed by their names or in document order
+		// Get the child (first parameter) of the child (Action element) of the document (actionrequest)
+		h = findHandlers(mydata->Cookie);
+		pushActionParams(L, ixmlNode_getFirstChild(ixmlNode_getFirstChild((IXML_Node*)request)), (h != NULL && h->positional));
 
 		// TODO: add address info, check *NIX vs Wid32 differences, and IPv4 vs IPv6
 		//lua_pushstring(L, "CtrlCpIPAddr");
 		//lua_pushstring(L, UpnpString_get_String(UpnpActionRequest_get_CtrlCpIPAddr(arEvent)));
 		//lua_settable(L, -3);
+		latencyStage(mydata, LPNP_STAGE_DECODE);
+		counterInc(mydata->EventType, LPNP_COUNT_DECODED);
 		result = 2;	// 2 return arguments, callback + table
 	}
 	//UpnpActionRequest_delete(arEvent);  do not release resources, the 'return' call still needs them
-	//free(mydata);
+	//releaseDelivery(mydata);
 	return result;
 }
 
@@ -679,15 +1367,14 @@ static int decodeUpnpActionRequest(lua_State *L, void* pData, void* utilid)
 static int returnUpnpActionRequest(lua_State *L, void* pData, void* utilid, int garbage)
 {
 	int err = 0;
-	int i = 1;
 	cbdelivery* mydata = (cbdelivery*)pData;
 	UpnpActionRequest* arEvent = (UpnpActionRequest*)mydata->Event;
 	IXML_Document* RetList = NULL;
 	IXML_Document* ActionRequest = NULL;
 	IXML_Node* ActionNameNode = NULL;
 	const DOMString ServiceType = NULL;
-	const char* paramName = NULL;
-	const char* paramValue = NULL;
+	const char* ActionName = NULL;
+	xmlbuffer b;
 	
 	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
 	if (L == NULL)
@@ -696,13 +1383,15 @@ static int returnUpnpActionRequest(lua_State *L, void* pData, void* utilid, int
 		UpnpActionRequest_set_ActionResult(arEvent, NULL);
 		UpnpActionRequest_set_ErrCode(arEvent, 501);
 		UpnpActionRequest_strcpy_ErrStr(arEvent, "Action Failed");
-		if (garbage) deliverUpnpCallbackError("Error: a UpnpActionRequest was left unanswered and was garbage collected.", NULL);
+		counterInc(mydata->EventType, LPNP_COUNT_CANCELLED);
+		if (garbage) errorReport("Error: a UpnpActionRequest was left unanswered and was garbage collected.", mydata->Cookie);
 		return 0;
 	}
 	else
 	{
 		// Check arguments
 		if (garbage) return 0;		// exit immediately, calling thread ('deliver' function) will cleanup
+		latencyStage(mydata, LPNP_STAGE_LUA);
 		lua_checkstack(L, 6);
 		if (lua_gettop(L) == 2 && lua_isnumber(L,1) && lua_isstring(L,2))
 		{
@@ -736,54 +1425,22 @@ static int returnUpnpActionRequest(lua_State *L, void* pData, void* utilid, int
 		}
 
 		lua_settop(L,2);	// clear remainder of stack
-		// iterate over provided tables
-		while (1)
+		// serialize the provided tables into a response, and parse it once
+		ActionName = UpnpString_get_String(UpnpActionRequest_get_ActionName(arEvent));
+		xmlInit(&b, 256);
+		xmlStartActionResponse(&b, ActionName, ServiceType);
+		xmlAddLuaArrays(L, &b, 1, 2, FALSE);
+		xmlEndActionResponse(&b, ActionName);
+		err = xmlParse(&b, &RetList);
+		if (err != UPNP_E_SUCCESS)
 		{
-			lua_pushinteger(L, i);
-			lua_gettable(L, 1); // gets the argname at pos 3
-			if (lua_isnil(L,-1))
-			{
-				// we're done
-				lua_settop(L, 2);
-				if (RetList == NULL)
-				{
-					// No return arguments? create empty to prevent the upnplib from returning an error
-					UpnpAddToActionResponse(&RetList, 
-						UpnpString_get_String(UpnpActionRequest_get_ActionName(arEvent)),
-					    ServiceType,
-					    NULL,
-					    NULL);
-				}
-				break;
-			}
-			lua_pushinteger(L, i);
-			lua_gettable(L, 2); // gets the argvalue at pos 4
-			// duplicate the key, to prevent auto string conversion
-			lua_pushvalue(L, 3);	// copy at pos 5
-			lua_pushvalue(L, 4);	// copy at pos 6
-			paramName = lua_tolstring(L, 5, NULL);
-			paramValue = lua_tolstring(L, 6, NULL);
-
-			// Add to (and create if necessary) actionresponse
-			if (UpnpAddToActionResponse(&RetList, 
-						UpnpString_get_String(UpnpActionRequest_get_ActionName(arEvent)),
-					    ServiceType,
-					    paramName,
-					    paramValue) != UPNP_E_SUCCESS)
-			{
-				// error adding element
-				lua_settop(L,2);	
-				if (RetList != NULL) ixmlDocument_free(RetList);
-				UpnpActionRequest_set_ActionResult(arEvent, NULL);
-				UpnpActionRequest_set_ErrCode(arEvent, 501);
-				UpnpActionRequest_strcpy_ErrStr(arEvent, "Action Failed");
-				lua_pushnil(L);
-				lua_pushstring(L, "Error: Invalid data in name/value table provided to ActionRequest");
-				return 2;
-			}
-			// remove copy of key and value from stack and proceed to next one
-			lua_settop(L,2);	
-			i += 1;
+			// error adding element
+			UpnpActionRequest_set_ActionResult(arEvent, NULL);
+			UpnpActionRequest_set_ErrCode(arEvent, 501);
+			UpnpActionRequest_strcpy_ErrStr(arEvent, "Action Failed");
+			lua_pushnil(L);
+			lua_pushstring(L, "Error: Invalid data in name/value table provided to ActionRequest");
+			return 2;
 		}
 		//succeeded, store results
 		UpnpActionRequest_set_ActionResult(arEvent, RetList);
@@ -796,15 +1453,27 @@ static int returnUpnpActionRequest(lua_State *L, void* pData, void* utilid, int
 int deliverUpnpActionRequest(Upnp_EventType EventType, const UpnpActionRequest *arEvent, void* cookie)
 {
 	int err = DSS_SUCCESS;
-	cbdelivery* mydata = (cbdelivery*)malloc(sizeof(cbdelivery));
+	cbdelivery* mydata;
+	cbaction action;
 	IXML_Document* idoc = NULL;
+	int ms = callbackGetDeadline(cookie);
 
+	if (storeAnswerAction((UpnpActionRequest *)arEvent)) return 0;	// answered from the state store
+	if (!callbackWanted(EventType, cookie) || !queueAdmit(EventType, cookie))
+	{
+		// no handler, or dropped by queue policy
+		UpnpActionRequest_set_ActionResult((UpnpActionRequest *)arEvent, NULL);
+		UpnpActionRequest_set_ErrCode((UpnpActionRequest *)arEvent, 501);
+		UpnpActionRequest_strcpy_ErrStr((UpnpActionRequest *)arEvent, "Action Failed");
+		return dropEvent(EventType);
+	}
+	mydata = newDelivery(EventType, cookie);
 	if (mydata == NULL)
 	{
 		UpnpActionRequest_set_ActionResult((UpnpActionRequest *)arEvent, NULL);
 		UpnpActionRequest_set_ErrCode((UpnpActionRequest *)arEvent, 603);
 		UpnpActionRequest_strcpy_ErrStr((UpnpActionRequest *)arEvent, "Out of Memory");
-		deliverUpnpCallbackError("Out of memory allocating 'mydata' for UpnpActionRequest callback.", cookie);
+		errorReport("Out of memory allocating 'mydata' for UpnpActionRequest callback.", cookie);
 		return 0;
 	}
 
@@ -812,13 +1481,24 @@ int deliverUpnpActionRequest(Upnp_EventType EventType, const UpnpActionRequest *
 	mydata->EventType = EventType;
 	mydata->Event = (void*)arEvent;
 	mydata->Cookie = cookie;
+	mydata->Extra = &action;
+	actionStart(&action, (UpnpActionRequest *)arEvent, (ms != 0));
 
-	// Deliver it, blocks until finished
-	err = DSS_deliver(cookie, &decodeUpnpActionRequest, &returnUpnpActionRequest, mydata);
+	// Deliver it, blocks until finished, or the deadline passed
+	err = pendingDeliver(mydata, ms, &decodeUpnpActionRequest, &returnUpnpActionRequest);
+	latencyStage(mydata, LPNP_STAGE_RETURN);
+	countRequest(mydata, err);
 
-	if (err != DSS_SUCCESS)
+	if (err == LPNP_PENDING_EXPIRED)
 	{
-		deliverUpnpCallbackError("Error delivering 'event' for UpnpActionRequest callback.", cookie);
+		errorReport("Deadline expired for UpnpActionRequest callback, responded with 'Action Failed'.", cookie);
+		UpnpActionRequest_set_ActionResult((UpnpActionRequest *)arEvent, NULL);
+		UpnpActionRequest_set_ErrCode((UpnpActionRequest *)arEvent, 501);
+		UpnpActionRequest_strcpy_ErrStr((UpnpActionRequest *)arEvent, "Action Failed");
+	}
+	else if (err != DSS_SUCCESS)
+	{
+		errorReport("Error delivering 'event' for UpnpActionRequest callback.", cookie);
 		if (err > DSS_SUCCESS) // it's a warning; in this case data is still delivered and shouldn't be released
 		{
 			UpnpActionRequest_set_ErrCode((UpnpActionRequest *)arEvent, 501);
@@ -827,14 +1507,19 @@ int deliverUpnpActionRequest(Upnp_EventType EventType, const UpnpActionRequest *
 	}
 
 	// clear the IXML docs from Lua, to prevent further Lua access (about to be destroyed by another thread)
-	idoc = UpnpActionRequest_get_ActionRequest(arEvent);
-	if (idoc != NULL) clearLuaNode((IXML_Node*)idoc);
-	idoc = UpnpActionRequest_get_ActionResult(arEvent);
-	if (idoc != NULL) clearLuaNode((IXML_Node*)idoc);
-	idoc = UpnpActionRequest_get_SoapHeader(arEvent);
-	if (idoc != NULL) clearLuaNode((IXML_Node*)idoc);
-
-	free(mydata);
+	actionDone(&action);	// no new wrappers after this
+	if (!action.detached)	// if detached, Lua only got clones, and may still be using them
+	{
+		idoc = UpnpActionRequest_get_ActionRequest(arEvent);
+		if (idoc != NULL) clearLuaNode((IXML_Node*)idoc);
+		idoc = UpnpActionRequest_get_ActionResult(arEvent);
+		if (idoc != NULL) clearLuaNode((IXML_Node*)idoc);
+		idoc = UpnpActionRequest_get_SoapHeader(arEvent);
+		if (idoc != NULL) clearLuaNode((IXML_Node*)idoc);
+	}
+
+	latencyDone(mydata);
+	releaseDelivery(mydata);
 	return 0;
 }
 
@@ -4,6 +4,7 @@
 //#include <ixml.h>
 #include <lua.h>
 #include <string.h>
+#include <ctype.h>
 #include "upnptools.h"
 //#include <lauxlib.h>
 #include "luaIXML.h"
@@ -11,6 +12,18 @@
 #include "darksidesync_aux.h"
 #include "luaUPnPdefinitions.h"
 #include "luaUPnPsupport.h"
+#include "luaUPnPqueue.h"
+#include "luaUPnPpool.h"
+#include "luaUPnPring.h"
+#include "luaUPnPdedup.h"
+#include "luaUPnPstore.h"
+#include "luaUPnPpending.h"
+#include "luaUPnPxml.h"
+#include "luaUPnPlatency.h"
+#include "luaUPnPcounters.h"
+#include "luaUPnPshard.h"
+#include "luaUPnPerrors.h"
+#include "luaUPnPrecycle.h"
 
 /*
 ** ===============================================================
@@ -26,4 +39,18 @@ int deliverUpnpSubscriptionRequest(Upnp_EventType EventType, const UpnpSubscript
 int deliverUpnpStateVarRequest(Upnp_EventType EventType, const UpnpStateVarRequest *svrEvent, void* cookie);
 int deliverUpnpActionRequest(Upnp_EventType EventType, const UpnpActionRequest *arEvent, void* cookie);
 
+void callbackInitialize();
+int callbackEventType(const char* name);
+void callbackSetHandler(lua_State *L, Upnp_EventType EventType, int idx);
+void callbackClearHandlers(lua_State *L);
+void callbackResetOptions(void* utilid);
+void callbackSetLazy(lua_State *L, int enable);
+void callbackSetPositional(lua_State *L, int enable);
+void callbackSetDeadline(lua_State *L, int ms);
+int callbackGetDeadline(void* utilid);
+int L_EventIndex(lua_State *L);
+int L_ActionRequestIndex(lua_State *L);
+int L_DestroyEvent(lua_State *L);
+int L_eventtostring(lua_State *L);
+
 #endif  /* LuaUPnPcallback_h */
\ No newline at end of file
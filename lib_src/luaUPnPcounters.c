@@ -0,0 +1,81 @@
+#include "luaUPnPcounters.h"
+
+/*
+** ===============================================================
+**   Delivery counters
+** ===============================================================
+** Counters per event type, updated with atomic operations so they can
+** be maintained on every callback without locking. Next to the event
+** counters, the number of delivery records in flight (allocated, but not
+** yet released) and its peak value are tracked.
+*/
+
+static const char* counternames[LPNP_COUNTERS] = { "received", "delivered", "decoded",
+	"dropped", "oom", "dsserror", "cancelled" };
+
+static volatile long counters[LPNP_EVENTTYPES][LPNP_COUNTERS];
+static volatile long inflight[LPNP_EVENTTYPES];
+static volatile long peak[LPNP_EVENTTYPES];
+
+void counterInc(Upnp_EventType EventType, int counter)
+{
+	if (EventType < 0 || EventType >= LPNP_EVENTTYPES) return;
+	LPNP_INC(&counters[EventType][counter]);
+}
+
+// A delivery record was allocated
+void counterEnter(Upnp_EventType EventType)
+{
+	long current, highest;
+
+	if (EventType < 0 || EventType >= LPNP_EVENTTYPES) return;
+	current = LPNP_INC(&inflight[EventType]);
+	highest = peak[EventType];
+	while (current > highest && !LPNP_CAS(&peak[EventType], highest, current))
+		highest = peak[EventType];
+}
+
+// A delivery record was released
+void counterLeave(Upnp_EventType EventType)
+{
+	if (EventType < 0 || EventType >= LPNP_EVENTTYPES) return;
+	LPNP_DEC(&inflight[EventType]);
+}
+
+// Resets the counters, and the peaks to the current number in flight.
+// Updates running concurrently may be lost.
+void countersClear()
+{
+	int et, i;
+
+	for (et = 0; et < LPNP_EVENTTYPES; et++)
+	{
+		for (i = 0; i < LPNP_COUNTERS; i++) counters[et][i] = 0;
+		peak[et] = inflight[et];
+	}
+	LPNP_BARRIER();
+}
+
+// Pushes a table with the counters by event type name, event types that
+// have not been received are omitted
+void countersPushStats(lua_State *L)
+{
+	int et, i;
+
+	lua_newtable(L);
+	for (et = 0; et < LPNP_EVENTTYPES; et++)
+	{
+		if (counters[et][LPNP_COUNT_RECEIVED] == 0 && inflight[et] == 0 && peak[et] == 0) continue;
+		lua_createtable(L, 0, LPNP_COUNTERS + 2);
+		for (i = 0; i < LPNP_COUNTERS; i++)
+		{
+			lua_pushnumber(L, (lua_Number)counters[et][i]);
+			lua_setfield(L, -2, counternames[i]);
+		}
+		lua_pushnumber(L, (lua_Number)inflight[et]);
+		lua_setfield(L, -2, "inflight");
+		lua_pushnumber(L, (lua_Number)peak[et]);
+		lua_setfield(L, -2, "peak");
+		lua_setfield(L, -2, UpnpGetEventType(et));
+	}
+}
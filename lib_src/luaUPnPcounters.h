@@ -0,0 +1,29 @@
+#ifndef LuaUPnPcounters_h
+#define LuaUPnPcounters_h
+
+#include <lua.h>
+#include "luaUPnPdefinitions.h"
+#include "luaUPnPsupport.h"
+
+/*
+** ===============================================================
+**   Delivery counters
+** ===============================================================
+*/
+
+#define LPNP_COUNT_RECEIVED 0		// callbacks received from pupnp
+#define LPNP_COUNT_DELIVERED 1		// handed to DSS, the batch queue or the ring
+#define LPNP_COUNT_DECODED 2		// pushed to Lua
+#define LPNP_COUNT_DROPPED 3		// never reached Lua; no handler, queue policy, ring full, DSS error, expired
+#define LPNP_COUNT_OOM 4			// out of memory
+#define LPNP_COUNT_DSSERROR 5		// DSS delivery errors
+#define LPNP_COUNT_CANCELLED 6		// requests left unanswered; garbage collected or DSS unregistered
+#define LPNP_COUNTERS 7
+
+void counterInc(Upnp_EventType EventType, int counter);
+void counterEnter(Upnp_EventType EventType);
+void counterLeave(Upnp_EventType EventType);
+void countersClear();
+void countersPushStats(lua_State *L);
+
+#endif  /* LuaUPnPcounters_h */
@@ -0,0 +1,290 @@
+#include "luaUPnPdedup.h"
+
+/*
+** ===============================================================
+**   SSDP deduplication
+** ===============================================================
+** Devices announce every USN multiple times, per service and per
+** interface. The cache remembers the advertisements forwarded to Lua,
+** keyed on DeviceID + ServiceType + Location. A repeat is suppressed
+** until half of its 'Expires' period has passed, so Lua still receives
+** a refresh before the advertisement expires. Changed advertisements
+** (other device type, service version or OS) are always forwarded.
+** A byebye removes the entries for the DeviceID + ServiceType.
+** The cache is shared by the Lua states, but the entries are kept per
+** state (by utilid, the pupnp cookie), so one state never suppresses an
+** advertisement another state has not seen yet.
+*/
+
+typedef struct _dedupentry {
+	struct _dedupentry* next;
+	void* utilid;				// Lua state the advertisement was forwarded to
+	unsigned long hash;
+	unsigned long fingerprint;	// hash of the non-key fields
+	time_t refresh;				// suppress repeats until this time
+	time_t expires;				// entry is no longer valid after this time
+	size_t idlen;				// length of DeviceID + ServiceType part of the key
+	char key[1];				// DeviceID \n ServiceType \n Location, allocated beyond struct
+} dedupentry;
+
+static dedupentry* buckets[LPNP_DEDUP_BUCKETS];
+static volatile int dedupsize = 0;	// max number of entries, 0 = disabled
+static int dedupcount = 0;
+static time_t lastpurge = 0;		// last time the expired entries were purged
+static unsigned long forwarded = 0;
+static unsigned long suppressed = 0;
+static unsigned long changed = 0;
+static unsigned long refreshed = 0;
+static unsigned long removed = 0;
+static unsigned long overflow = 0;
+static ithread_mutex_t deduplock;
+
+void dedupInitialize()
+{
+	memset(buckets, 0, sizeof(buckets));
+	ithread_mutex_init(&deduplock, NULL);
+}
+
+// FNV-1a hash, continuing from 'hash'
+static unsigned long dedupHash(unsigned long hash, const char* str)
+{
+	if (str == NULL) return hash;
+	while (*str != 0)
+	{
+		hash ^= (unsigned char)*str;
+		hash *= 16777619UL;
+		str++;
+	}
+	hash ^= '\n';
+	hash *= 16777619UL;
+	return hash;
+}
+#define DEDUP_HASH_INIT 2166136261UL
+
+// Removes all entries (for which 'expiredonly' is FALSE) or only the expired ones,
+// of a utilid, or of all if 'utilid' is NULL. Must be called while holding the lock.
+static void dedupPurge(void* utilid, int expiredonly, time_t now)
+{
+	int i;
+	dedupentry** link;
+	dedupentry* entry;
+	for (i = 0; i < LPNP_DEDUP_BUCKETS; i++)
+	{
+		link = &buckets[i];
+		while (*link != NULL)
+		{
+			entry = *link;
+			if ((utilid == NULL || entry->utilid == utilid) && (!expiredonly || entry->expires <= now))
+			{
+				*link = entry->next;
+				free(entry);
+				dedupcount -= 1;
+			}
+			else
+				link = &entry->next;
+		}
+	}
+}
+
+// Sets the max number of entries in the cache, 0 disables deduplication
+// (and clears the cache).
+void dedupSetSize(int size)
+{
+	if (size < 0) size = 0;
+	if (size > LPNP_MAX_DEDUPSIZE) size = LPNP_MAX_DEDUPSIZE;
+	ithread_mutex_lock(&deduplock);
+	dedupsize = size;
+	if (size == 0) dedupPurge(NULL, FALSE, 0);
+	ithread_mutex_unlock(&deduplock);
+}
+
+// Removes the entries of a utilid
+void dedupClear(void* utilid)
+{
+	ithread_mutex_lock(&deduplock);
+	dedupPurge(utilid, FALSE, 0);
+	ithread_mutex_unlock(&deduplock);
+}
+
+// Removes the entries of a utilid matching DeviceID + ServiceType (any
+// Location). Must be called while holding the lock.
+static void dedupRemove(void* utilid, const char* idkey, size_t idlen)
+{
+	int i;
+	dedupentry** link;
+	dedupentry* entry;
+	// the bucket depends on the Location, so check all
+	for (i = 0; i < LPNP_DEDUP_BUCKETS; i++)
+	{
+		link = &buckets[i];
+		while (*link != NULL)
+		{
+			entry = *link;
+			if (entry->utilid == utilid && entry->idlen == idlen && memcmp(entry->key, idkey, idlen) == 0)
+			{
+				*link = entry->next;
+				free(entry);
+				dedupcount -= 1;
+				removed += 1;
+			}
+			else
+				link = &entry->next;
+		}
+	}
+}
+
+// Checks a discovery event for the Lua state 'cookie' against the cache.
+// Returns TRUE if the event must be forwarded to Lua, FALSE if it is a repeat.
+int dedupCheck(Upnp_EventType EventType, const UpnpDiscovery *dEvent, void* cookie)
+{
+	const char* DeviceID;
+	const char* ServiceType;
+	const char* Location;
+	char* key;
+	size_t idlen, keylen;
+	unsigned long hash, fingerprint;
+	dedupentry* entry;
+	time_t now;
+	int expires;
+	int result = TRUE;
+
+	if (dedupsize == 0 || dEvent == NULL) return TRUE;		// disabled, or timeout event; quick check, rechecked while locked
+	if (EventType != UPNP_DISCOVERY_ADVERTISEMENT_ALIVE &&
+		EventType != UPNP_DISCOVERY_SEARCH_RESULT &&
+		EventType != UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE) return TRUE;
+	if (UpnpDiscovery_get_ErrCode(dEvent) != UPNP_E_SUCCESS) return TRUE;
+
+	DeviceID = UpnpString_get_String(UpnpDiscovery_get_DeviceID(dEvent));
+	ServiceType = UpnpString_get_String(UpnpDiscovery_get_ServiceType(dEvent));
+	Location = UpnpString_get_String(UpnpDiscovery_get_Location(dEvent));
+	if (DeviceID == NULL) DeviceID = "";
+	if (ServiceType == NULL) ServiceType = "";
+	if (Location == NULL) Location = "";
+
+	// build the key
+	idlen = strlen(DeviceID) + strlen(ServiceType) + 2;
+	keylen = idlen + strlen(Location);
+	key = (char*)malloc(keylen + 1);
+	if (key == NULL) return TRUE;		// can't check, just forward
+	sprintf(key, "%s\n%s\n%s", DeviceID, ServiceType, Location);
+	hash = dedupHash(DEDUP_HASH_INIT, key);
+	fingerprint = dedupHash(DEDUP_HASH_INIT, UpnpString_get_String(UpnpDiscovery_get_DeviceType(dEvent)));
+	fingerprint = dedupHash(fingerprint, UpnpString_get_String(UpnpDiscovery_get_ServiceVer(dEvent)));
+	fingerprint = dedupHash(fingerprint, UpnpString_get_String(UpnpDiscovery_get_Os(dEvent)));
+	now = time(NULL);
+	expires = UpnpDiscovery_get_Expires(dEvent);
+
+	ithread_mutex_lock(&deduplock);
+	if (dedupsize == 0)
+	{
+		// disabled in the meantime
+		ithread_mutex_unlock(&deduplock);
+		free(key);
+		return TRUE;
+	}
+	if (EventType == UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE)
+	{
+		dedupRemove(cookie, key, idlen);
+		forwarded += 1;
+		ithread_mutex_unlock(&deduplock);
+		free(key);
+		return TRUE;
+	}
+
+	entry = buckets[hash % LPNP_DEDUP_BUCKETS];
+	while (entry != NULL && (entry->hash != hash || entry->utilid != cookie || strcmp(entry->key, key) != 0)) entry = entry->next;
+
+	if (entry != NULL)
+	{
+		if (entry->fingerprint != fingerprint)
+		{
+			changed += 1;
+		}
+		else if (now < entry->refresh)
+		{
+			suppressed += 1;
+			result = FALSE;
+		}
+		else
+		{
+			refreshed += 1;
+		}
+		if (result)
+		{
+			// forwarded, so restart the window
+			entry->fingerprint = fingerprint;
+			entry->refresh = now + expires / 2;
+			entry->expires = now + expires;
+		}
+	}
+	else
+	{
+		// new entry
+		if (dedupcount >= dedupsize && now != lastpurge)
+		{
+			// full, remove expired ones. Scanning the whole cache is expensive,
+			// so at most once per second; until then new entries overflow
+			dedupPurge(NULL, TRUE, now);
+			lastpurge = now;
+		}
+		if (dedupcount < dedupsize)
+		{
+			entry = (dedupentry*)malloc(sizeof(dedupentry) + keylen);
+			if (entry != NULL)
+			{
+				entry->utilid = cookie;
+				entry->hash = hash;
+				entry->fingerprint = fingerprint;
+				entry->refresh = now + expires / 2;
+				entry->expires = now + expires;
+				entry->idlen = idlen;
+				memcpy(entry->key, key, keylen + 1);
+				entry->next = buckets[hash % LPNP_DEDUP_BUCKETS];
+				buckets[hash % LPNP_DEDUP_BUCKETS] = entry;
+				dedupcount += 1;
+			}
+		}
+		else
+			overflow += 1;		// still full, forward without caching
+	}
+	if (result) forwarded += 1;
+	ithread_mutex_unlock(&deduplock);
+	free(key);
+	return result;
+}
+
+// Pushes a table with the cache counters
+void dedupPushStats(lua_State *L)
+{
+	unsigned long stats[6];
+	int size, count;
+
+	ithread_mutex_lock(&deduplock);
+	stats[0] = forwarded;
+	stats[1] = suppressed;
+	stats[2] = changed;
+	stats[3] = refreshed;
+	stats[4] = removed;
+	stats[5] = overflow;
+	size = dedupsize;
+	count = dedupcount;
+	ithread_mutex_unlock(&deduplock);
+
+	lua_createtable(L, 0, 8);
+	lua_pushinteger(L, size);
+	lua_setfield(L, -2, "size");
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "entries");
+	lua_pushnumber(L, (lua_Number)stats[0]);
+	lua_setfield(L, -2, "forwarded");
+	lua_pushnumber(L, (lua_Number)stats[1]);
+	lua_setfield(L, -2, "suppressed");
+	lua_pushnumber(L, (lua_Number)stats[2]);
+	lua_setfield(L, -2, "changed");
+	lua_pushnumber(L, (lua_Number)stats[3]);
+	lua_setfield(L, -2, "refreshed");
+	lua_pushnumber(L, (lua_Number)stats[4]);
+	lua_setfield(L, -2, "removed");
+	lua_pushnumber(L, (lua_Number)stats[5]);
+	lua_setfield(L, -2, "overflow");
+}
@@ -0,0 +1,28 @@
+#ifndef LuaUPnPdedup_h
+#define LuaUPnPdedup_h
+
+#include <lua.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ithread.h"
+#include "luaUPnPdefinitions.h"
+
+/*
+** ===============================================================
+**   SSDP deduplication
+** ===============================================================
+*/
+
+// Number of hash buckets in the cache
+#define LPNP_DEDUP_BUCKETS 256
+// Upper limit for the number of entries in the cache
+#define LPNP_MAX_DEDUPSIZE 100000
+
+void dedupInitialize();
+void dedupSetSize(int size);
+int dedupCheck(Upnp_EventType EventType, const UpnpDiscovery *dEvent, void* cookie);
+void dedupClear(void* utilid);
+void dedupPushStats(lua_State *L);
+
+#endif  /* LuaUPnPdedup_h */
@@ -4,7 +4,7 @@
 #include "upnp.h"
 //#include "upnptools.h"
 //#include "uuid.h"
-//#include <lua.h>
+#include <lua.h>
 //#include <lauxlib.h>
 //#include "luaIXML.h"
 //#include "darksidesync_aux.h"
@@ -16,6 +16,19 @@
 	#define LPNP_API extern
 #endif
 
+// Atomic operations on 'volatile long' values (used by the ring and the counters)
+#ifdef WIN32
+	#define LPNP_CAS(ptr, oldval, newval) (InterlockedCompareExchange((ptr), (newval), (oldval)) == (oldval))
+	#define LPNP_INC(ptr) InterlockedIncrement(ptr)
+	#define LPNP_DEC(ptr) InterlockedDecrement(ptr)
+	#define LPNP_BARRIER() MemoryBarrier()
+#else
+	#define LPNP_CAS(ptr, oldval, newval) __sync_bool_compare_and_swap((ptr), (oldval), (newval))
+	#define LPNP_INC(ptr) __sync_add_and_fetch((ptr), 1)
+	#define LPNP_DEC(ptr) __sync_sub_and_fetch((ptr), 1)
+	#define LPNP_BARRIER() __sync_synchronize()
+#endif
+
 // Callback name in the registry
 #define UPNPCALLBACK "LuaUPnP.callback"
 
@@ -24,6 +37,9 @@
 #define LPNP_LIBRARY_MT "LuaUPnP.LibUserData.MT"	
 #define LPNP_DEVICE_MT "LuaUPnP.Device"	
 #define LPNP_CLIENT_MT "LuaUPnP.Client"	
+#define LPNP_EVENT_MT "LuaUPnP.Event"	
+#define LPNP_PENDING_MT "LuaUPnP.PendingRequest"	
+#define LPNP_ACTIONREQUEST_MT "LuaUPnP.ActionRequest"	
 
 // Registry (weak) table name with userdata references by pointers (lightuserdata)
 #define LPNP_WTABLE_UPNP "LuaUPnP.UPnPuserdata"
@@ -70,13 +86,45 @@ static struct _EventTypes EventTypes[] = {
 	{UPNP_EVENT_SUBSCRIPTION_EXPIRED, "UPNP_EVENT_SUBSCRIPTION_EXPIRED"},
 };
 
+// Number of event types (Upnp_EventType values)
+#define LPNP_EVENTTYPES (UPNP_EVENT_SUBSCRIPTION_EXPIRED + 1)
+
+// Timestamp in microseconds, for the latency statistics
+#ifdef WIN32
+	typedef __int64 lpnp_time;
+#else
+	typedef long long lpnp_time;
+#endif
+
 // async delivery struct
+struct _cbdelivery;
+// Decoder for async events; pushes the event table if L != NULL and
+// releases the delivery record. Returns 1 if a table was pushed, 0 otherwise.
+typedef int (*cbdecoder)(lua_State *L, struct _cbdelivery* mydata);
+// Pushes field 'idx' of the event data, returns 0 (nothing pushed) if the
+// field is not set. May take ownership of the pushed value (documents).
+typedef int (*cbfield)(lua_State *L, void* Event, int idx);
+// Releases the event data
+typedef void (*cbfree)(void* Event);
+// Description of the event data of an async event type
+typedef struct _cbeventinfo {
+	const char** fields;	// field names, NULL terminated
+	int count;				// number of fields
+	cbfield Field;
+	cbfree Free;
+} cbeventinfo;
 typedef struct _cbdelivery {
 	Upnp_EventType EventType;
 	void* Event;
 	void* Cookie;
 	void* Extra;		// just an extra pointer
 	int handle;			// either client or device handle
+	cbdecoder Decode;	// async events only; decodes and releases the record
+	const cbeventinfo* Info;	// async events only; describes the event data
+	struct _cbdelivery* Next;	// async events only; next record in a batch
+	lpnp_time Created;	// latency statistics; time pupnp called back, 0 if not recorded
+	lpnp_time Stamp;	// latency statistics; end of the last recorded stage
+	int Stage;			// latency statistics; next stage to record
 } cbdelivery;
 
 
@@ -0,0 +1,226 @@
+#include "luaUPnPerrors.h"
+
+/*
+** ===============================================================
+**   Internal error reporting
+** ===============================================================
+** Errors are reported by static message, which doubles as the error
+** code. Instead of a DSS delivery per error, the errors are collected in
+** a fixed size table, with a repeat count and first/last timestamps, and
+** a single delivery per Lua state is outstanding at any time. When Lua
+** picks it up, all errors for that state are drained at once, with
+** repeats coalesced into a single line. So during overload, reporting an
+** error is only a short locked scan of the table.
+** Errors that do not fit in the table are counted per Lua state in a
+** separate (smaller) table, and reported to that state as lost.
+*/
+
+typedef struct _errorslot {
+	const char* msg;		// static message, NULL if the slot is free
+	void* cookie;			// utilid of the Lua state to report to
+	unsigned long count;
+	time_t first;
+	time_t last;
+} errorslot;
+
+typedef struct _errorlost {
+	void* cookie;			// utilid of the Lua state to report to
+	unsigned long count;	// errors lost, not yet reported
+} errorlost;
+
+static errorslot slots[LPNP_ERRORSLOTS];
+static int slotcount = 0;					// slots in use, always the first ones
+static errorlost lostslots[LPNP_ERRORSTATES];
+static int lostslotcount = 0;				// lost slots in use, always the first ones
+static unsigned long reported = 0;			// errors reported
+static unsigned long deliveries = 0;		// DSS deliveries done for them
+static unsigned long lost = 0;				// errors lost; table full, or delivery failed
+static ithread_mutex_t errorlock;
+
+void errorsInitialize()
+{
+	ithread_mutex_init(&errorlock, NULL);
+}
+
+// Removes the errors of a Lua state, returns the number of errors removed.
+// Requires the lock.
+static unsigned long errorsRemove(void* cookie)
+{
+	unsigned long count = 0;
+	int i, j = 0;
+
+	for (i = 0; i < slotcount; i++)
+	{
+		if (slots[i].cookie == cookie)
+			count += slots[i].count;
+		else
+			slots[j++] = slots[i];
+	}
+	slotcount = j;
+	return count;
+}
+
+// Returns the lost slot of a Lua state, or NULL. Requires the lock.
+static errorlost* errorsFindLost(void* cookie)
+{
+	int i;
+	for (i = 0; i < lostslotcount; i++)
+		if (lostslots[i].cookie == cookie) return &lostslots[i];
+	return NULL;
+}
+
+// Removes the lost slot of a Lua state, returns its count. Requires the lock.
+static unsigned long errorsRemoveLost(void* cookie)
+{
+	errorlost* l = errorsFindLost(cookie);
+	unsigned long count;
+
+	if (l == NULL) return 0;
+	count = l->count;
+	*l = lostslots[--lostslotcount];	// move the last one in its place
+	return count;
+}
+
+// Decoder for the error delivery; drains the errors for the Lua state and
+// calls the callback with nil + the messages, one per line
+static int decodeErrors(lua_State *L, void* pData, void* utilid)
+{
+	errorslot drained[LPNP_ERRORSLOTS];
+	unsigned long missed;
+	luaL_Buffer b;
+	int count = 0;
+	int i;
+
+	ithread_mutex_lock(&errorlock);
+	if (L == NULL)
+	{
+		// DSS is unregistering the UPNP lib and we can't access Lua
+		errorsRemove(pData);
+		errorsRemoveLost(pData);
+		ithread_mutex_unlock(&errorlock);
+		return 0;
+	}
+	for (i = 0; i < slotcount; i++)
+	{
+		if (slots[i].cookie == utilid) drained[count++] = slots[i];
+	}
+	errorsRemove(utilid);
+	missed = errorsRemoveLost(utilid);
+	ithread_mutex_unlock(&errorlock);
+
+	// Push the callback function first
+	lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
+	lua_pushnil(L);
+	luaL_buffinit(L, &b);
+	for (i = 0; i < count; i++)
+	{
+		if (i > 0) luaL_addchar(&b, '\n');
+		luaL_addstring(&b, drained[i].msg);
+		if (drained[i].count > 1)
+		{
+			lua_pushfstring(L, " (x %d, within %d seconds)", (int)drained[i].count, (int)(drained[i].last - drained[i].first));
+			luaL_addvalue(&b);
+		}
+	}
+	if (missed > 0)
+	{
+		lua_pushfstring(L, "%s%d errors were lost, too many different errors.", (count > 0 ? "\n" : ""), (int)missed);
+		luaL_addvalue(&b);
+	}
+	luaL_pushresult(&b);
+	return 3;
+}
+
+// Reports an error to the Lua state identified by 'cookie'. 'msg' must be
+// a static string. Returns DSS_SUCCESS, or the DSS error if a delivery
+// failed.
+int errorReport(const char* msg, void* cookie)
+{
+	time_t now = time(NULL);
+	errorlost* l;
+	int deliver = TRUE;
+	int err = DSS_SUCCESS;
+	int i;
+
+	ithread_mutex_lock(&errorlock);
+	reported++;
+	l = errorsFindLost(cookie);
+	if (l != NULL) deliver = FALSE;		// a delivery for this Lua state is outstanding
+	for (i = 0; i < slotcount; i++)
+	{
+		if (slots[i].cookie != cookie) continue;
+		deliver = FALSE;		// a delivery for this Lua state is outstanding
+		if (slots[i].msg == msg) break;
+	}
+	if (i < slotcount)
+	{
+		// repeat, coalesce
+		slots[i].count++;
+		slots[i].last = now;
+	}
+	else if (slotcount < LPNP_ERRORSLOTS)
+	{
+		slots[slotcount].msg = msg;
+		slots[slotcount].cookie = cookie;
+		slots[slotcount].count = 1;
+		slots[slotcount].first = now;
+		slots[slotcount].last = now;
+		slotcount++;
+	}
+	else
+	{
+		// table full, count it for the Lua state
+		lost++;
+		if (l == NULL && lostslotcount < LPNP_ERRORSTATES)
+		{
+			l = &lostslots[lostslotcount++];
+			l->cookie = cookie;
+			l->count = 0;
+		}
+		if (l != NULL)
+			l->count++;		// delivered by the outstanding delivery, or a new one
+		else
+			deliver = FALSE;	// only in the statistics
+	}
+	if (deliver) deliveries++;
+	ithread_mutex_unlock(&errorlock);
+
+	if (deliver)
+	{
+		err = DSS_deliver(cookie, &decodeErrors, NULL, cookie);
+		if (err < DSS_SUCCESS)
+		{
+			// not delivered, nobody will drain them
+			ithread_mutex_lock(&errorlock);
+			lost += errorsRemove(cookie);
+			errorsRemoveLost(cookie);		// counted as lost already
+			ithread_mutex_unlock(&errorlock);
+		}
+	}
+	return err;
+}
+
+// Pushes a table with the fields 'reported', 'deliveries', 'lost' and
+// 'waiting' (errors currently waiting for Lua)
+void errorsPushStats(lua_State *L)
+{
+	unsigned long r, d, l, w = 0;
+	int i;
+
+	ithread_mutex_lock(&errorlock);
+	r = reported;
+	d = deliveries;
+	l = lost;
+	for (i = 0; i < slotcount; i++) w += slots[i].count;
+	ithread_mutex_unlock(&errorlock);
+
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, (lua_Number)r);
+	lua_setfield(L, -2, "reported");
+	lua_pushnumber(L, (lua_Number)d);
+	lua_setfield(L, -2, "deliveries");
+	lua_pushnumber(L, (lua_Number)l);
+	lua_setfield(L, -2, "lost");
+	lua_pushnumber(L, (lua_Number)w);
+	lua_setfield(L, -2, "waiting");
+}
@@ -0,0 +1,27 @@
+#ifndef LuaUPnPerrors_h
+#define LuaUPnPerrors_h
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <string.h>
+#include <time.h>
+#include "ithread.h"
+#include "darksidesync_aux.h"
+#include "luaUPnPdefinitions.h"
+
+/*
+** ===============================================================
+**   Internal error reporting
+** ===============================================================
+*/
+
+// Number of distinct errors that can be waiting to be reported
+#define LPNP_ERRORSLOTS 32
+// Number of Lua states for which lost errors can be waiting to be reported
+#define LPNP_ERRORSTATES 16
+
+void errorsInitialize();
+int errorReport(const char* msg, void* cookie);
+void errorsPushStats(lua_State *L);
+
+#endif  /* LuaUPnPerrors_h */
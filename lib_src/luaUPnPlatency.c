@@ -0,0 +1,212 @@
+#include "luaUPnPlatency.h"
+
+/*
+** ===============================================================
+**   Latency statistics of the callback pipeline
+** ===============================================================
+** When enabled, each delivery record is timestamped when pupnp calls
+** back, and at the end of each stage of the pipeline. The durations are
+** recorded per event type and stage, in histograms with logarithmic
+** buckets (HDR style); values below 16 microseconds are exact, larger
+** values are grouped by their power of 2, subdivided in 8 buckets (so
+** within 12.5% of the actual value).
+*/
+
+#define LATENCY_EXACT 16		// values with their own bucket
+#define LATENCY_SUBBITS 3		// 2^3 sub buckets per power of 2
+#define LATENCY_MAXPOWER 40		// largest power of 2 (about 12 days in microseconds)
+#define LATENCY_BUCKETS (LATENCY_EXACT + (LATENCY_MAXPOWER - 3) * (1 << LATENCY_SUBBITS))
+
+typedef struct _histogram {
+	unsigned long count;
+	lpnp_time sum;
+	lpnp_time max;
+	unsigned long buckets[LATENCY_BUCKETS];
+} histogram;
+
+static const char* stagenames[LPNP_STAGES] = { "queue", "decode", "lua", "return" };
+
+static histogram histograms[LPNP_EVENTTYPES][LPNP_STAGES + 1];	// last one is the total
+static volatile int latencyenabled = FALSE;
+static ithread_mutex_t latencylock;
+
+void latencyInitialize()
+{
+	ithread_mutex_init(&latencylock, NULL);
+	memset(histograms, 0, sizeof(histograms));
+}
+
+// Enables/disables timestamping of new deliveries
+void latencySetEnabled(int enable)
+{
+	latencyenabled = enable;
+}
+
+// Returns the current time in microseconds, from a monotonic clock if available
+static lpnp_time latencyNow()
+{
+#ifdef WIN32
+	static LARGE_INTEGER frequency = { 0 };
+	LARGE_INTEGER now;
+	if (frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&now);
+	return (lpnp_time)((now.QuadPart / frequency.QuadPart) * 1000000 + (now.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (lpnp_time)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (lpnp_time)now.tv_sec * 1000000 + now.tv_usec;
+#endif
+}
+
+// Returns the bucket for a duration
+static int latencyBucket(lpnp_time value)
+{
+	int power = 0;
+
+	if (value < LATENCY_EXACT) return (value < 0 ? 0 : (int)value);
+	while ((value >> power) > 1) power++;
+	if (power > LATENCY_MAXPOWER) return LATENCY_BUCKETS - 1;
+	return LATENCY_EXACT + (power - 4) * (1 << LATENCY_SUBBITS)
+		+ (int)((value >> (power - LATENCY_SUBBITS)) & ((1 << LATENCY_SUBBITS) - 1));
+}
+
+// Returns the highest duration that falls in a bucket
+static lpnp_time latencyBucketValue(int bucket)
+{
+	int power, sub;
+
+	if (bucket < LATENCY_EXACT) return bucket;
+	power = (bucket - LATENCY_EXACT) / (1 << LATENCY_SUBBITS) + 4;
+	sub = (bucket - LATENCY_EXACT) % (1 << LATENCY_SUBBITS);
+	return ((lpnp_time)((1 << LATENCY_SUBBITS) + sub + 1) << (power - LATENCY_SUBBITS)) - 1;
+}
+
+static void latencyRecord(Upnp_EventType EventType, int stage, lpnp_time value)
+{
+	histogram* h;
+
+	if (EventType < 0 || EventType >= LPNP_EVENTTYPES) return;
+	h = &histograms[EventType][stage];
+	ithread_mutex_lock(&latencylock);
+	h->count += 1;
+	h->sum += value;
+	if (value > h->max) h->max = value;
+	h->buckets[latencyBucket(value)] += 1;
+	ithread_mutex_unlock(&latencylock);
+}
+
+// Timestamps a new delivery record, when pupnp calls back
+void latencyStart(cbdelivery* mydata)
+{
+	mydata->Stage = LPNP_STAGE_QUEUE;
+	mydata->Created = (latencyenabled ? latencyNow() : 0);
+	mydata->Stamp = mydata->Created;
+}
+
+// Records the duration of a stage, since the end of the previous one. Only
+// recorded if the stages are completed in order, so a request that was
+// cancelled or expired is only included in the total.
+void latencyStage(cbdelivery* mydata, int stage)
+{
+	lpnp_time now;
+
+	if (mydata->Created == 0 || mydata->Stage != stage) return;
+	now = latencyNow();
+	latencyRecord(mydata->EventType, stage, now - mydata->Stamp);
+	mydata->Stamp = now;
+	mydata->Stage = stage + 1;
+}
+
+// Records the total duration, since pupnp called back
+void latencyDone(cbdelivery* mydata)
+{
+	if (mydata->Created == 0) return;
+	latencyRecord(mydata->EventType, LPNP_STAGES, latencyNow() - mydata->Created);
+	mydata->Created = 0;
+}
+
+// Resets all histograms
+void latencyClear()
+{
+	ithread_mutex_lock(&latencylock);
+	memset(histograms, 0, sizeof(histograms));
+	ithread_mutex_unlock(&latencylock);
+}
+
+// Returns the duration below which 'fraction' of the values fall
+static lpnp_time latencyPercentile(const histogram* h, double fraction)
+{
+	unsigned long target = (unsigned long)(h->count * fraction + 0.5);
+	unsigned long seen = 0;
+	lpnp_time value;
+	int i;
+
+	if (target == 0) target = 1;
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+	{
+		seen += h->buckets[i];
+		if (seen >= target)
+		{
+			value = latencyBucketValue(i);
+			return (value > h->max ? h->max : value);
+		}
+	}
+	return h->max;
+}
+
+// Pushes a table with count, mean, max and percentiles of a histogram
+static void latencyPushHistogram(lua_State *L, const histogram* h)
+{
+	lua_createtable(L, 0, 7);
+	lua_pushnumber(L, (lua_Number)h->count);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, (lua_Number)h->sum / h->count);
+	lua_setfield(L, -2, "mean");
+	lua_pushnumber(L, (lua_Number)h->max);
+	lua_setfield(L, -2, "max");
+	lua_pushnumber(L, (lua_Number)latencyPercentile(h, 0.5));
+	lua_setfield(L, -2, "p50");
+	lua_pushnumber(L, (lua_Number)latencyPercentile(h, 0.9));
+	lua_setfield(L, -2, "p90");
+	lua_pushnumber(L, (lua_Number)latencyPercentile(h, 0.99));
+	lua_setfield(L, -2, "p99");
+	lua_pushnumber(L, (lua_Number)latencyPercentile(h, 0.999));
+	lua_setfield(L, -2, "p999");
+}
+
+// Pushes a table with the latency statistics (in microseconds) by event
+// type name, and for each event type by stage; queue, decode, lua, return
+// and total. Event types and stages without recorded values are omitted.
+void latencyPushStats(lua_State *L)
+{
+	histogram* copy;
+	int et, stage;
+
+	// copy, to prevent keeping the lock while calling Lua
+	copy = (histogram*)lua_newuserdata(L, sizeof(histograms));
+	ithread_mutex_lock(&latencylock);
+	memcpy(copy, histograms, sizeof(histograms));
+	ithread_mutex_unlock(&latencylock);
+
+	lua_newtable(L);
+	lua_pushboolean(L, latencyenabled);
+	lua_setfield(L, -2, "enabled");
+	for (et = 0; et < LPNP_EVENTTYPES; et++)
+	{
+		histogram* h = copy + et * (LPNP_STAGES + 1);
+		if (h[LPNP_STAGES].count == 0 && h[LPNP_STAGE_QUEUE].count == 0) continue;
+		lua_createtable(L, 0, LPNP_STAGES + 1);
+		for (stage = 0; stage <= LPNP_STAGES; stage++)
+		{
+			if (h[stage].count == 0) continue;
+			latencyPushHistogram(L, &h[stage]);
+			lua_setfield(L, -2, (stage == LPNP_STAGES ? "total" : stagenames[stage]));
+		}
+		lua_setfield(L, -2, UpnpGetEventType(et));
+	}
+	lua_remove(L, -2);	// remove the copy
+}
@@ -0,0 +1,37 @@
+#ifndef LuaUPnPlatency_h
+#define LuaUPnPlatency_h
+
+#include <lua.h>
+#include <string.h>
+#ifdef WIN32
+	#include <winsock2.h>	// includes windows.h, must precede it
+#else
+	#include <time.h>
+	#include <sys/time.h>
+#endif
+#include "ithread.h"
+#include "luaUPnPdefinitions.h"
+#include "luaUPnPsupport.h"
+
+/*
+** ===============================================================
+**   Latency statistics of the callback pipeline
+** ===============================================================
+*/
+
+// Stages of the pipeline, recorded in this order
+#define LPNP_STAGE_QUEUE 0		// from pupnp calling back, until decoding starts
+#define LPNP_STAGE_DECODE 1		// decoding the event for Lua
+#define LPNP_STAGE_LUA 2		// blocking requests only; Lua handler, until it returns the results
+#define LPNP_STAGE_RETURN 3		// blocking requests only; handling the results, until the pupnp thread resumes
+#define LPNP_STAGES 4
+
+void latencyInitialize();
+void latencySetEnabled(int enable);
+void latencyStart(cbdelivery* mydata);
+void latencyStage(cbdelivery* mydata, int stage);
+void latencyDone(cbdelivery* mydata);
+void latencyClear();
+void latencyPushStats(lua_State *L);
+
+#endif  /* LuaUPnPlatency_h */
@@ -0,0 +1,337 @@
+#include "luaUPnPpending.h"
+
+/*
+** ===============================================================
+**   Deadline for blocking device requests
+** ===============================================================
+** Without a deadline, action and subscription requests are delivered
+** through DSS with a 'return' function, which blocks the pupnp thread
+** until Lua responds. With a deadline the request is delivered without
+** one; the decoder pushes a 'pending request' userdata as the callback
+** (instead of the DSS one) and the pupnp thread waits for it with a
+** timeout. The record is shared by the pupnp thread and the Lua side,
+** and released when both are done with it. While the Lua side accesses
+** the event (decoding it, or calling the return function) the state is
+** 'busy', and the pupnp thread will wait for it to complete, even beyond
+** the deadline, because the event data is owned by the pupnp thread.
+*/
+
+#define PENDING_WAITING 0		// waiting for Lua to respond
+#define PENDING_BUSY 1			// Lua side is accessing the event
+#define PENDING_ANSWERED 2		// done, Lua responded (or was cancelled)
+#define PENDING_EXPIRED 3		// done, deadline passed before Lua responded
+
+typedef struct _cbpending {
+	int state;
+	int refs;					// pupnp thread + Lua side (DSS queue or userdata)
+	ithread_cond_t cond;		// signalled when the state changes
+	cbdelivery* mydata;
+	void* utilid;
+	DSS_decoder_1v0_t pDecode;
+	DSS_return_1v0_t pReturn;
+} cbpending;
+
+// userdata for the Lua side
+typedef struct _luapending {
+	cbpending* pending;			// NULL once responded
+} luapending;
+
+static unsigned long delivered = 0;
+static unsigned long answered = 0;
+static unsigned long expired = 0;
+static unsigned long late = 0;			// responses discarded after expiry
+static ithread_mutex_t pendinglock;
+
+void pendingInitialize()
+{
+	ithread_mutex_init(&pendinglock, NULL);
+}
+
+// Drops a reference, the last one frees the record
+static void pendingRelease(cbpending* p)
+{
+	int last;
+	ithread_mutex_lock(&pendinglock);
+	p->refs -= 1;
+	last = (p->refs == 0);
+	ithread_mutex_unlock(&pendinglock);
+	if (last)
+	{
+		ithread_cond_destroy(&p->cond);
+		free(p);
+	}
+}
+
+// Sets a new state, and wakes up the pupnp thread
+static void pendingSetState(cbpending* p, int state)
+{
+	ithread_mutex_lock(&pendinglock);
+	p->state = state;
+	ithread_cond_signal(&p->cond);
+	ithread_mutex_unlock(&pendinglock);
+}
+
+// Claims access to the event, returns TRUE if the state was 'waiting'
+static int pendingClaim(cbpending* p)
+{
+	int result;
+	ithread_mutex_lock(&pendinglock);
+	result = (p->state == PENDING_WAITING);
+	if (result) p->state = PENDING_BUSY;
+	ithread_mutex_unlock(&pendinglock);
+	return result;
+}
+
+// Calls the original decoder, called protected. The record is at upvalue 1,
+// the utilid at upvalue 2.
+static int pendingDecode(lua_State *L)
+{
+	cbpending* p = (cbpending*)lua_touserdata(L, lua_upvalueindex(1));
+	return p->pDecode(L, p->mydata, lua_touserdata(L, lua_upvalueindex(2)));
+}
+
+// Calls the original return function with the results on the stack, called
+// protected. The record is at upvalue 1.
+static int pendingReturn(lua_State *L)
+{
+	cbpending* p = (cbpending*)lua_touserdata(L, lua_upvalueindex(1));
+	return p->pReturn(L, p->mydata, p->utilid, FALSE);
+}
+
+// Fails the request and wakes up the pupnp thread; the request must be
+// claimed by the caller. Drops the reference of the caller.
+static void pendingFail(cbpending* p)
+{
+	p->pReturn(NULL, p->mydata, p->utilid, FALSE);
+	pendingSetState(p, PENDING_ANSWERED);
+	pendingRelease(p);
+}
+
+// DSS decoder; decodes the request through the original decoder and
+// inserts the pending request userdata as first argument. While the
+// request is claimed no Lua errors may escape, as the pupnp thread waits
+// for it, so the userdata is created upfront and the decoder is called
+// protected.
+static int decodePending(lua_State *L, void* pData, void* utilid)
+{
+	cbpending* p = (cbpending*)pData;
+	luapending* lp = NULL;
+	int top, n;
+
+	if (L != NULL)
+	{
+		// DSS decoders may not raise errors, so check the stack space
+		if (!lua_checkstack(L, 4)) L = NULL;
+		else
+		{
+			lp = (luapending*)lua_newuserdata(L, sizeof(luapending));
+			lp->pending = NULL;		// not yet owning a reference
+			luaL_getmetatable(L, LPNP_PENDING_MT);
+			lua_setmetatable(L, -2);
+		}
+	}
+	if (!pendingClaim(p))
+	{
+		// expired while queued, the event is gone
+		if (lp != NULL) lua_pop(L, 1);
+		pendingRelease(p);
+		return 0;
+	}
+	if (L == NULL)
+	{
+		// DSS is unregistering, fail the request
+		pendingFail(p);
+		return 0;
+	}
+
+	top = lua_gettop(L);	// the userdata
+	lua_pushlightuserdata(L, p);
+	lua_pushlightuserdata(L, utilid);
+	lua_pushcclosure(L, &pendingDecode, 2);
+	if (lua_pcall(L, 0, LUA_MULTRET, 0) != 0)
+	{
+		// out of memory, fail the request
+		lua_settop(L, top - 1);
+		pendingFail(p);
+		return 0;
+	}
+	n = lua_gettop(L) - top;	// pushed handler + event table
+	if (n == 0)
+	{
+		lua_settop(L, top - 1);
+		pendingFail(p);
+		return 0;
+	}
+	// the userdata takes over the reference, move it after the handler
+	lp->pending = p;
+	lua_pushvalue(L, top);
+	lua_remove(L, top);
+	lua_insert(L, -n);
+	pendingSetState(p, PENDING_WAITING);	// the deadline applies again
+	return n + 1;
+}
+
+// __call method of the pending request userdata; calls the return
+// function of the request if it has not expired yet.
+// Returns; the results of the return function, or nil + errormsg
+int L_PendingCall(lua_State *L)
+{
+	luapending* lp = (luapending*)luaL_checkudata(L, 1, LPNP_PENDING_MT);
+	cbpending* p = lp->pending;
+	int n;
+
+	if (p == NULL)
+	{
+		lua_pushnil(L);
+		lua_pushstring(L, "Error: the request has already been answered");
+		return 2;
+	}
+	lp->pending = NULL;
+	if (!pendingClaim(p))
+	{
+		ithread_mutex_lock(&pendinglock);
+		late += 1;
+		ithread_mutex_unlock(&pendinglock);
+		pendingRelease(p);
+		lua_pushnil(L);
+		lua_pushstring(L, "Error: the request expired before it was answered");
+		return 2;
+	}
+	lua_remove(L, 1);	// remove the userdata, only the results remain
+	// called protected, the pupnp thread waits while the request is claimed
+	lua_pushlightuserdata(L, p);
+	lua_pushcclosure(L, &pendingReturn, 1);
+	lua_insert(L, 1);
+	if (lua_pcall(L, lua_gettop(L) - 1, LUA_MULTRET, 0) != 0)
+	{
+		pendingFail(p);
+		lua_error(L);	// rethrow, the request is released
+	}
+	n = lua_gettop(L);
+	ithread_mutex_lock(&pendinglock);
+	answered += 1;
+	ithread_mutex_unlock(&pendinglock);
+	pendingSetState(p, PENDING_ANSWERED);
+	pendingRelease(p);
+	return n;
+}
+
+// GC method for the pending request userdata, fails the request if it was
+// left unanswered
+int L_DestroyPending(lua_State *L)
+{
+	luapending* lp = (luapending*)lua_touserdata(L, 1);
+	cbpending* p = lp->pending;
+
+	if (p == NULL) return 0;
+	lp->pending = NULL;
+	if (pendingClaim(p))
+	{
+		p->pReturn(NULL, p->mydata, p->utilid, TRUE);
+		pendingSetState(p, PENDING_ANSWERED);
+	}
+	pendingRelease(p);
+	return 0;
+}
+
+// Calculates the absolute time 'ms' milliseconds from now
+static void pendingDeadline(struct timespec* abstime, int ms)
+{
+#ifdef WIN32
+	struct _timeb now;
+	_ftime(&now);
+	abstime->tv_sec = (long)now.time + ms / 1000;
+	abstime->tv_nsec = ((long)now.millitm + ms % 1000) * 1000000L;
+#else
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	abstime->tv_sec = now.tv_sec + ms / 1000;
+	abstime->tv_nsec = ((long)now.tv_usec + (ms % 1000) * 1000L) * 1000L;
+#endif
+	if (abstime->tv_nsec >= 1000000000L)
+	{
+		abstime->tv_sec += 1;
+		abstime->tv_nsec -= 1000000000L;
+	}
+}
+
+// Delivers a blocking request, and waits for the Lua response. If a deadline
+// 'ms' is given (see callbackGetDeadline), the wait ends when it passes.
+// Returns the DSS result, or LPNP_PENDING_EXPIRED if the deadline passed,
+// in which case the return function has not been called.
+int pendingDeliver(cbdelivery* mydata, int ms, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn)
+{
+	cbpending* p;
+	struct timespec abstime;
+	int err;
+
+	if (ms == 0) return DSS_deliver(mydata->Cookie, pDecode, pReturn, mydata);
+
+	p = (cbpending*)malloc(sizeof(cbpending));
+	if (p == NULL) return DSS_ERR_OUT_OF_MEMORY;
+	p->state = PENDING_WAITING;
+	p->refs = 2;
+	p->mydata = mydata;
+	p->utilid = mydata->Cookie;
+	p->pDecode = pDecode;
+	p->pReturn = pReturn;
+	ithread_cond_init(&p->cond, NULL);
+	pendingDeadline(&abstime, ms);
+
+	err = DSS_deliver(mydata->Cookie, &decodePending, NULL, p);
+	if (err < DSS_SUCCESS)
+	{
+		// not queued, so we're the only owner
+		ithread_cond_destroy(&p->cond);
+		free(p);
+		return err;
+	}
+
+	ithread_mutex_lock(&pendinglock);
+	delivered += 1;
+	while (p->state == PENDING_WAITING || p->state == PENDING_BUSY)
+	{
+		if (ithread_cond_timedwait(&p->cond, &pendinglock, &abstime) != ETIMEDOUT) continue;
+		if (p->state == PENDING_WAITING)
+		{
+			p->state = PENDING_EXPIRED;
+			expired += 1;
+		}
+		else if (p->state == PENDING_BUSY)
+		{
+			// Lua is still accessing the event, it cannot expire until it is
+			// done (never raising errors while busy), recheck periodically
+			pendingDeadline(&abstime, LPNP_PENDING_RECHECK);
+		}
+	}
+	if (p->state == PENDING_EXPIRED) err = LPNP_PENDING_EXPIRED;
+	ithread_mutex_unlock(&pendinglock);
+	pendingRelease(p);
+	return err;
+}
+
+// Pushes a table with the deadline (of the calling Lua state) and the
+// request counters
+void pendingPushStats(lua_State *L, int deadline)
+{
+	unsigned long stats[4];
+
+	ithread_mutex_lock(&pendinglock);
+	stats[0] = delivered;
+	stats[1] = answered;
+	stats[2] = expired;
+	stats[3] = late;
+	ithread_mutex_unlock(&pendinglock);
+
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, deadline);
+	lua_setfield(L, -2, "deadline");
+	lua_pushnumber(L, (lua_Number)stats[0]);
+	lua_setfield(L, -2, "delivered");
+	lua_pushnumber(L, (lua_Number)stats[1]);
+	lua_setfield(L, -2, "answered");
+	lua_pushnumber(L, (lua_Number)stats[2]);
+	lua_setfield(L, -2, "expired");
+	lua_pushnumber(L, (lua_Number)stats[3]);
+	lua_setfield(L, -2, "late");
+}
@@ -0,0 +1,35 @@
+#ifndef LuaUPnPpending_h
+#define LuaUPnPpending_h
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <errno.h>
+#ifdef WIN32
+	#include <sys/timeb.h>
+#else
+	#include <sys/time.h>
+#endif
+#include "ithread.h"
+#include "darksidesync_aux.h"
+#include "luaUPnPdefinitions.h"
+
+/*
+** ===============================================================
+**   Deadline for blocking device requests
+** ===============================================================
+*/
+
+// Upper limit for the deadline in milliseconds
+#define LPNP_MAX_DEADLINE 600000
+// Interval in milliseconds to recheck a request that is busy past its deadline
+#define LPNP_PENDING_RECHECK 100
+// Returned by pendingDeliver if the request was not answered before the deadline
+#define LPNP_PENDING_EXPIRED 1
+
+void pendingInitialize();
+int pendingDeliver(cbdelivery* mydata, int ms, DSS_decoder_1v0_t pDecode, DSS_return_1v0_t pReturn);
+void pendingPushStats(lua_State *L, int deadline);
+int L_PendingCall(lua_State *L);
+int L_DestroyPending(lua_State *L);
+
+#endif  /* LuaUPnPpending_h */
@@ -0,0 +1,145 @@
+#include "luaUPnPpool.h"
+
+/*
+** ===============================================================
+**   Pooled allocation of delivery records and payloads
+** ===============================================================
+** Delivery records are allocated on the pupnp threads and released on
+** the Lua thread. To prevent allocator contention, released items are
+** kept in a freelist and reused. Each pool has its own lock, held only
+** for a couple of pointer operations.
+*/
+
+// Free items are linked through their first bytes
+typedef struct _poolitem {
+	struct _poolitem* next;
+} poolitem;
+
+typedef struct _lpnppool {
+	size_t size;				// size of the items in this pool
+	poolitem* free;				// freelist
+	int count;					// number of items in the freelist
+	unsigned long hits;			// allocations served from the freelist
+	unsigned long misses;		// allocations that required a malloc
+	ithread_mutex_t lock;
+} lpnppool;
+
+static lpnppool deliverypool;
+static lpnppool payloadpool;
+
+static void poolSetup(lpnppool* pool, size_t size)
+{
+	pool->size = size;
+	pool->free = NULL;
+	pool->count = 0;
+	pool->hits = 0;
+	pool->misses = 0;
+	ithread_mutex_init(&pool->lock, NULL);
+}
+
+// Initializes the pools, must be called before any other pool function
+void poolInitialize()
+{
+	poolSetup(&deliverypool, sizeof(cbdelivery));
+	poolSetup(&payloadpool, LPNP_POOL_SLABSIZE);
+}
+
+static void* poolAlloc(lpnppool* pool)
+{
+	poolitem* item;
+	ithread_mutex_lock(&pool->lock);
+	item = pool->free;
+	if (item != NULL)
+	{
+		pool->free = item->next;
+		pool->count -= 1;
+		pool->hits += 1;
+		ithread_mutex_unlock(&pool->lock);
+		return item;
+	}
+	pool->misses += 1;
+	ithread_mutex_unlock(&pool->lock);
+	return malloc(pool->size);
+}
+
+static void poolRelease(lpnppool* pool, void* p)
+{
+	poolitem* item = (poolitem*)p;
+	if (item == NULL) return;
+	ithread_mutex_lock(&pool->lock);
+	if (pool->count < LPNP_POOL_MAXFREE)
+	{
+		item->next = pool->free;
+		pool->free = item;
+		pool->count += 1;
+		item = NULL;
+	}
+	ithread_mutex_unlock(&pool->lock);
+	if (item != NULL) free(item);	// pool is full
+}
+
+// Allocates a delivery record, returns NULL if out of memory
+cbdelivery* poolNewDelivery()
+{
+	return (cbdelivery*)poolAlloc(&deliverypool);
+}
+
+void poolFreeDelivery(cbdelivery* mydata)
+{
+	poolRelease(&deliverypool, mydata);
+}
+
+// Allocates a payload buffer of 'size' bytes, returns NULL if out of memory.
+// The same size must be provided when releasing it.
+void* poolNewPayload(size_t size)
+{
+	if (size > LPNP_POOL_SLABSIZE)
+	{
+		// too large for a slab, count as miss
+		ithread_mutex_lock(&payloadpool.lock);
+		payloadpool.misses += 1;
+		ithread_mutex_unlock(&payloadpool.lock);
+		return malloc(size);
+	}
+	return poolAlloc(&payloadpool);
+}
+
+void poolFreePayload(void* payload, size_t size)
+{
+	if (size > LPNP_POOL_SLABSIZE)
+		free(payload);
+	else
+		poolRelease(&payloadpool, payload);
+}
+
+// Pushes a table with the statistics of a single pool
+static void poolPushPool(lua_State *L, lpnppool* pool)
+{
+	unsigned long hits, misses;
+	int count;
+	ithread_mutex_lock(&pool->lock);
+	hits = pool->hits;
+	misses = pool->misses;
+	count = pool->count;
+	ithread_mutex_unlock(&pool->lock);
+
+	lua_createtable(L, 0, 4);
+	lua_pushnumber(L, (lua_Number)hits);
+	lua_setfield(L, -2, "hits");
+	lua_pushnumber(L, (lua_Number)misses);
+	lua_setfield(L, -2, "misses");
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "free");
+	lua_pushinteger(L, (int)pool->size);
+	lua_setfield(L, -2, "size");
+}
+
+// Pushes a table with the statistics of all pools
+void poolPushStats(lua_State *L)
+{
+	lua_createtable(L, 0, 2);
+	poolPushPool(L, &deliverypool);
+	lua_setfield(L, -2, "delivery");
+	poolPushPool(L, &payloadpool);
+	lua_setfield(L, -2, "payload");
+}
@@ -0,0 +1,26 @@
+#ifndef LuaUPnPpool_h
+#define LuaUPnPpool_h
+
+#include <lua.h>
+#include "ithread.h"
+#include "luaUPnPdefinitions.h"
+
+/*
+** ===============================================================
+**   Pooled allocation of delivery records and payloads
+** ===============================================================
+*/
+
+// Size of a payload slab, larger payloads are allocated individually
+#define LPNP_POOL_SLABSIZE 512
+// Maximum number of free items kept in a pool, the excess is released
+#define LPNP_POOL_MAXFREE 256
+
+void poolInitialize();
+cbdelivery* poolNewDelivery();
+void poolFreeDelivery(cbdelivery* mydata);
+void* poolNewPayload(size_t size);
+void poolFreePayload(void* payload, size_t size);
+void poolPushStats(lua_State *L);
+
+#endif  /* LuaUPnPpool_h */
@@ -0,0 +1,533 @@
+#include "luaUPnPqueue.h"
+
+/*
+** ===============================================================
+**   Batched delivery of async callbacks
+** ===============================================================
+** Instead of a DSS_deliver call (and hence a Lua wake-up) for every
+** single event, events are collected in a batch. Only the first event
+** of a batch is delivered through DSS, every event arriving until Lua
+** picks up the batch (or until the batch is full) is appended to it.
+** When decoded, the whole batch is handed to the callback as a single
+** array of event tables.
+*/
+
+// A batch of events, waiting to be decoded by Lua
+typedef struct _cbbatch {
+	struct _cbqueue* queue;		// owning queue
+	struct _cbbatch* next;		// next (newer) batch waiting in the queue
+	cbdelivery* first;
+	cbdelivery* last;
+	int count;
+} cbbatch;
+
+// Event class administration, see queueAdmit()
+typedef struct _cbclass {
+	int limit;					// max events in flight, 0 = unlimited
+	int policy;					// LPNP_POLICY_xxx
+	int inflight;				// events delivered, but not yet released
+	unsigned long dropped;		// events dropped because of the limit
+} cbclass;
+
+static const cbclass classdefaults[LPNP_CLASS_COUNT] = {
+	{ 0, LPNP_POLICY_DROPNEWEST, 0, 0 },	// SSDP
+	{ 0, LPNP_POLICY_DROPNEWEST, 0, 0 },	// SOAP
+	{ 0, LPNP_POLICY_DROPNEWEST, 0, 0 },	// GENA
+	{ 0, LPNP_POLICY_BLOCK, 0, 0 },			// DEVICE
+};
+static const char* classnames[] = { "SSDP", "SOAP", "GENA", "DEVICE", NULL };
+static const char* policynames[] = { "dropoldest", "dropnewest", "block", NULL };
+
+// Queue administration, one for each utilid (Lua state)
+typedef struct _cbqueue {
+	void* utilid;
+	int batchsize;				// max items per batch, 0 = batching disabled
+	cbbatch* open;				// batch currently accepting new events, or NULL
+	cbbatch* waiting;			// batches delivered, but not yet decoded (oldest first)
+	cbclass classes[LPNP_CLASS_COUNT];	// limits and counters, protected by 'classlock'
+	struct _cbqueue* next;
+} cbqueue;
+
+static cbqueue* queuelist = NULL;
+static ithread_mutex_t queuelock;
+static ithread_mutex_t classlock;
+static ithread_cond_t classcond;			// signalled when events are released
+static volatile int classstopping = FALSE;	// if set, nothing blocks anymore
+
+// Initializes the queue mutexes, must be called before any other queue function
+void queueInitialize()
+{
+	ithread_mutex_init(&queuelock, NULL);
+	ithread_mutex_init(&classlock, NULL);
+	ithread_cond_init(&classcond, NULL);
+}
+
+// Finds the queue for a utilid, creates one if not found and 'create' is set.
+// Must be called while holding the lock.
+static cbqueue* queueFind(void* utilid, int create)
+{
+	cbqueue* q = queuelist;
+	while (q != NULL && q->utilid != utilid) q = q->next;
+	if (q == NULL && create)
+	{
+		q = (cbqueue*)malloc(sizeof(cbqueue));
+		if (q != NULL)
+		{
+			q->utilid = utilid;
+			q->batchsize = 0;
+			q->open = NULL;
+			q->waiting = NULL;
+			memcpy(q->classes, classdefaults, sizeof(classdefaults));
+			q->next = queuelist;
+			queuelist = q;
+		}
+	}
+	return q;
+}
+
+// Sets the maximum batch size for a utilid, 0 disables batching.
+// Queue records are never released; a utilid can be reused by DSS, in which
+// case the record simply gets reused as well.
+void queueSetBatchSize(void* utilid, int size)
+{
+	cbqueue* q;
+	int i;
+	if (size < 0) size = 0;
+	if (size > LPNP_MAX_BATCHSIZE) size = LPNP_MAX_BATCHSIZE;
+	ithread_mutex_lock(&queuelock);
+	q = queueFind(utilid, (size != 0));
+	if (q != NULL)
+	{
+		q->batchsize = size;
+		q->open = NULL;		// close current batch, if any
+	}
+	ithread_mutex_unlock(&queuelock);
+	if (q != NULL && size == 0)
+	{
+		// nothing can be evicted anymore
+		ithread_mutex_lock(&classlock);
+		for (i = 0; i < LPNP_CLASS_COUNT; i++)
+			if (q->classes[i].policy == LPNP_POLICY_DROPOLDEST) q->classes[i].policy = LPNP_POLICY_DROPNEWEST;
+		ithread_mutex_unlock(&classlock);
+	}
+}
+
+int queueGetBatchSize(void* utilid)
+{
+	int result = 0;
+	cbqueue* q;
+	ithread_mutex_lock(&queuelock);
+	q = queueFind(utilid, FALSE);
+	if (q != NULL) result = q->batchsize;
+	ithread_mutex_unlock(&queuelock);
+	return result;
+}
+
+// Removes a batch from the list of waiting batches, and closes it.
+// Must be called while holding the lock.
+static void queueUnlinkBatch(cbbatch* batch)
+{
+	cbqueue* q = batch->queue;
+	cbbatch* prev = NULL;
+	cbbatch* b = q->waiting;
+
+	while (b != NULL && b != batch)
+	{
+		prev = b;
+		b = b->next;
+	}
+	if (b != NULL)
+	{
+		if (prev == NULL)
+			q->waiting = b->next;
+		else
+			prev->next = b->next;
+	}
+	if (q->open == batch) q->open = NULL;
+}
+
+// Releases all events in a batch, and the batch itself
+static void queueReleaseBatch(cbbatch* batch)
+{
+	cbdelivery* item;
+	while (batch->first != NULL)
+	{
+		item = batch->first;
+		batch->first = item->Next;
+		item->Decode(NULL, item);		// L == NULL; only release resources
+	}
+	poolFreePayload(batch, sizeof(cbbatch));
+}
+
+// Decodes a batch; calls the callback with an array of event tables
+static int decodeUpnpBatch(lua_State *L, void* pData, void* utilid)
+{
+	cbbatch* batch = (cbbatch*)pData;
+	cbdelivery* item;
+	int i = 0;
+
+	// close the batch, so no more events will be added or evicted
+	ithread_mutex_lock(&queuelock);
+	queueUnlinkBatch(batch);
+	ithread_mutex_unlock(&queuelock);
+
+	// if L == NULL; DSS is unregistering the UPNP lib and we can't access Lua
+	if (L == NULL)
+	{
+		queueReleaseBatch(batch);
+		return 0;
+	}
+
+	recycleStart(L);	// the event tables of the previous delivery are no longer used
+	// Push the callback function first
+	lua_getfield(L, LUA_REGISTRYINDEX, UPNPCALLBACK);
+	// Create the array and fill it with the event tables
+	lua_createtable(L, batch->count, 1);
+	while (batch->first != NULL)
+	{
+		item = batch->first;
+		batch->first = item->Next;
+		if (item->Decode(L, item))		// pushes table and releases item
+		{
+			i += 1;
+			lua_rawseti(L, -2, i);
+		}
+	}
+	lua_pushinteger(L, i);
+	lua_setfield(L, -2, "n");
+	poolFreePayload(batch, sizeof(cbbatch));
+	return 2;	// 2 return arguments, callback + array
+}
+
+// Delivers an event through the queue of its cookie (utilid). If batching
+// is enabled, the event is appended to the open batch, otherwise a new
+// batch is created and delivered.
+// Returns the DSS result, or LPNP_QUEUE_DISABLED. Upon DSS errors (not
+// warnings) the event has not been queued and remains owned by the caller.
+int queueDeliver(cbdelivery* mydata)
+{
+	void* cookie = mydata->Cookie;		// once queued, the record may be evicted and released
+	int err = DSS_SUCCESS;
+	cbqueue* q;
+	cbbatch* batch;
+	cbbatch* last;
+
+	mydata->Next = NULL;
+	ithread_mutex_lock(&queuelock);
+	q = queueFind(mydata->Cookie, FALSE);
+	if (q == NULL || q->batchsize == 0)
+	{
+		ithread_mutex_unlock(&queuelock);
+		return LPNP_QUEUE_DISABLED;		// not batching, caller must deliver itself
+	}
+	batch = q->open;
+	if (batch != NULL)
+	{
+		// add to existing batch
+		if (batch->last == NULL)
+			batch->first = mydata;		// all items were evicted
+		else
+			batch->last->Next = mydata;
+		batch->last = mydata;
+		batch->count += 1;
+		if (batch->count >= q->batchsize) q->open = NULL;	// full, close it
+		ithread_mutex_unlock(&queuelock);
+		return DSS_SUCCESS;
+	}
+
+	// no open batch, create a new one
+	batch = (cbbatch*)poolNewPayload(sizeof(cbbatch));
+	if (batch == NULL)
+	{
+		ithread_mutex_unlock(&queuelock);
+		return DSS_ERR_OUT_OF_MEMORY;
+	}
+	batch->queue = q;
+	batch->next = NULL;
+	batch->first = mydata;
+	batch->last = mydata;
+	batch->count = 1;
+	if (q->batchsize > 1) q->open = batch;
+	// append to the waiting list
+	if (q->waiting == NULL)
+		q->waiting = batch;
+	else
+	{
+		last = q->waiting;
+		while (last->next != NULL) last = last->next;
+		last->next = batch;
+	}
+	ithread_mutex_unlock(&queuelock);
+
+	err = DSS_deliver(cookie, &decodeUpnpBatch, NULL, batch);
+	if (err < DSS_SUCCESS)
+	{
+		// not delivered, close the batch and release whatever got added
+		// to it in the meantime, except the item of the caller (if it
+		// wasn't evicted already)
+		ithread_mutex_lock(&queuelock);
+		queueUnlinkBatch(batch);
+		ithread_mutex_unlock(&queuelock);
+		if (batch->first == mydata)
+		{
+			batch->first = mydata->Next;
+			mydata->Next = NULL;
+		}
+		else
+			err = DSS_SUCCESS;	// caller's item was evicted and released already
+		queueReleaseBatch(batch);
+	}
+	return err;
+}
+
+// Removes the oldest waiting event of a class from the batches of a utilid.
+// Returns the removed record (to be released by the caller), or NULL if
+// none was found.
+static cbdelivery* queueEvictOldest(void* utilid, int eventclass)
+{
+	cbqueue* q;
+	cbbatch* batch;
+	cbdelivery* item = NULL;
+	cbdelivery* prev;
+
+	ithread_mutex_lock(&queuelock);
+	q = queueFind(utilid, FALSE);
+	batch = (q == NULL) ? NULL : q->waiting;
+	while (batch != NULL && item == NULL)
+	{
+		prev = NULL;
+		item = batch->first;
+		while (item != NULL && queueClassOf(item->EventType) != eventclass)
+		{
+			prev = item;
+			item = item->Next;
+		}
+		if (item != NULL)
+		{
+			// found it, unlink
+			if (prev == NULL)
+				batch->first = item->Next;
+			else
+				prev->Next = item->Next;
+			if (batch->last == item) batch->last = prev;
+			batch->count -= 1;
+			item->Next = NULL;
+		}
+		batch = batch->next;
+	}
+	ithread_mutex_unlock(&queuelock);
+	return item;
+}
+
+/*
+** ===============================================================
+**   Event classes; limits and backpressure
+** ===============================================================
+** The number of events in flight (delivered by pupnp, not yet released
+** after decoding) is tracked per event class, for each Lua state (utilid)
+** separately, as the states sharing the stack each have their own Lua
+** thread and limits. If a class has a limit, a
+** new event exceeding it is handled according to the class policy;
+**   dropoldest : the oldest waiting event of the class is dropped. This
+**                requires batch delivery, as events handed to DSS or the
+**                ring individually cannot be removed again. It can only be
+**                set with batching enabled, disabling batching reverts it
+**                to 'dropnewest'.
+**   dropnewest : the new event is dropped
+**   block      : the pupnp thread delivering the event is blocked until
+**                Lua releases events of the class. Only for device
+**                requests, which block their pupnp thread anyway; for
+**                the other classes it would starve the pupnp thread pool.
+** Device requests have their own class, so their limit is independent of
+** the discovery traffic.
+*/
+
+int queueClassOf(Upnp_EventType EventType)
+{
+	switch (EventType)
+	{
+		case UPNP_DISCOVERY_ADVERTISEMENT_ALIVE:
+		case UPNP_DISCOVERY_SEARCH_RESULT:
+		case UPNP_DISCOVERY_SEARCH_TIMEOUT:
+		case UPNP_DISCOVERY_ADVERTISEMENT_BYEBYE:
+			return LPNP_CLASS_SSDP;
+		case UPNP_CONTROL_ACTION_COMPLETE:
+		case UPNP_CONTROL_GET_VAR_COMPLETE:
+			return LPNP_CLASS_SOAP;
+		case UPNP_EVENT_SUBSCRIPTION_REQUEST:
+		case UPNP_CONTROL_GET_VAR_REQUEST:
+		case UPNP_CONTROL_ACTION_REQUEST:
+			return LPNP_CLASS_DEVICE;
+		default:
+			return LPNP_CLASS_GENA;
+	}
+}
+
+// Returns the class index for a class name, or -1 if not found
+int queueClassByName(const char* name)
+{
+	int i;
+	for (i = 0; classnames[i] != NULL; i++)
+		if (strcmp(classnames[i], name) == 0) return i;
+	return -1;
+}
+
+// Returns the policy for a policy name, or -1 if not found
+int queuePolicyByName(const char* name)
+{
+	int i;
+	for (i = 0; policynames[i] != NULL; i++)
+		if (strcmp(policynames[i], name) == 0) return i;
+	return -1;
+}
+
+// Returns the queue record of a utilid, creates it if not found. Returns
+// NULL if out of memory. Records are never released, so the result can be
+// used after releasing the lock.
+static cbqueue* queueGet(void* utilid)
+{
+	cbqueue* q;
+	ithread_mutex_lock(&queuelock);
+	q = queueFind(utilid, TRUE);
+	ithread_mutex_unlock(&queuelock);
+	return q;
+}
+
+// Sets the limit and policy of an event class for a utilid.
+// Returns FALSE if out of memory.
+int queueSetLimit(void* utilid, int eventclass, int limit, int policy)
+{
+	cbqueue* q = queueGet(utilid);
+	if (q == NULL) return FALSE;
+	ithread_mutex_lock(&classlock);
+	q->classes[eventclass].limit = (limit < 0) ? 0 : limit;
+	q->classes[eventclass].policy = policy;
+	ithread_cond_broadcast(&classcond);		// blocked threads must recheck
+	ithread_mutex_unlock(&classlock);
+	return TRUE;
+}
+
+// Resets the limits and policies of a utilid to the defaults, to be called
+// when the Lua state stops, as the utilid may be reused by another state.
+// The counters are kept, events may still be in flight.
+void queueResetLimits(void* utilid)
+{
+	cbqueue* q;
+	int i;
+
+	ithread_mutex_lock(&queuelock);
+	q = queueFind(utilid, FALSE);
+	ithread_mutex_unlock(&queuelock);
+	if (q == NULL) return;
+	ithread_mutex_lock(&classlock);
+	for (i = 0; i < LPNP_CLASS_COUNT; i++)
+	{
+		q->classes[i].limit = classdefaults[i].limit;
+		q->classes[i].policy = classdefaults[i].policy;
+	}
+	ithread_cond_broadcast(&classcond);		// blocked threads must recheck
+	ithread_mutex_unlock(&classlock);
+}
+
+// Admits a new event for delivery, to be called by the pupnp thread before
+// allocating anything for it. Returns TRUE if the event may be delivered,
+// FALSE if it must be dropped. Every admitted event must be released by a
+// call to queueRelease().
+int queueAdmit(Upnp_EventType EventType, void* cookie)
+{
+	int eventclass = queueClassOf(EventType);
+	cbqueue* q = queueGet(cookie);
+	cbclass* c;
+	cbdelivery* evicted;
+
+	if (q == NULL) return TRUE;		// out of memory, can't apply limits
+	c = &q->classes[eventclass];
+	ithread_mutex_lock(&classlock);
+	while (c->limit != 0 && c->inflight >= c->limit)
+	{
+		if (c->policy == LPNP_POLICY_BLOCK && !classstopping)
+		{
+			ithread_cond_wait(&classcond, &classlock);
+			continue;
+		}
+		if (c->policy == LPNP_POLICY_DROPOLDEST)
+		{
+			ithread_mutex_unlock(&classlock);
+			evicted = queueEvictOldest(cookie, eventclass);
+			if (evicted != NULL) evicted->Decode(NULL, evicted);	// releases, decrements inflight
+			ithread_mutex_lock(&classlock);
+			if (evicted != NULL)
+			{
+				c->dropped += 1;
+				continue;
+			}
+		}
+		// drop the new one
+		c->dropped += 1;
+		ithread_mutex_unlock(&classlock);
+		return FALSE;
+	}
+	c->inflight += 1;
+	ithread_mutex_unlock(&classlock);
+	return TRUE;
+}
+
+// Releases an admitted event, see queueAdmit()
+void queueRelease(Upnp_EventType EventType, void* cookie)
+{
+	cbqueue* q;
+	cbclass* c;
+
+	ithread_mutex_lock(&queuelock);
+	q = queueFind(cookie, FALSE);
+	ithread_mutex_unlock(&queuelock);
+	if (q == NULL) return;			// admitted without a record, see queueAdmit()
+	c = &q->classes[queueClassOf(EventType)];
+	ithread_mutex_lock(&classlock);
+	if (c->inflight > 0) c->inflight -= 1;
+	if (c->limit != 0 && c->policy == LPNP_POLICY_BLOCK) ithread_cond_broadcast(&classcond);
+	ithread_mutex_unlock(&classlock);
+}
+
+// Sets the stopping flag, while set no threads will block on a limit.
+// Must be set before shutting down the pupnp threads, to prevent them from
+// waiting for a Lua side that no longer decodes.
+void queueStopping(int stopping)
+{
+	ithread_mutex_lock(&classlock);
+	classstopping = stopping;
+	ithread_cond_broadcast(&classcond);
+	ithread_mutex_unlock(&classlock);
+}
+
+// Pushes a table with the limits and counters of each event class of a
+// utilid (NULL if not started)
+void queuePushStats(lua_State *L, void* utilid)
+{
+	cbclass copy[LPNP_CLASS_COUNT];
+	cbqueue* q;
+	int i;
+
+	ithread_mutex_lock(&queuelock);
+	q = (utilid == NULL) ? NULL : queueFind(utilid, FALSE);
+	ithread_mutex_unlock(&queuelock);
+	// copy first, so no Lua calls are made while holding the lock
+	ithread_mutex_lock(&classlock);
+	memcpy(copy, (q == NULL) ? classdefaults : q->classes, sizeof(copy));
+	ithread_mutex_unlock(&classlock);
+
+	lua_createtable(L, 0, LPNP_CLASS_COUNT);
+	for (i = 0; i < LPNP_CLASS_COUNT; i++)
+	{
+		lua_createtable(L, 0, 4);
+		lua_pushinteger(L, copy[i].limit);
+		lua_setfield(L, -2, "limit");
+		lua_pushstring(L, policynames[copy[i].policy]);
+		lua_setfield(L, -2, "policy");
+		lua_pushinteger(L, copy[i].inflight);
+		lua_setfield(L, -2, "inflight");
+		lua_pushnumber(L, (lua_Number)copy[i].dropped);
+		lua_setfield(L, -2, "dropped");
+		lua_setfield(L, -2, classnames[i]);
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef LuaUPnPqueue_h
+#define LuaUPnPqueue_h
+
+#include <lua.h>
+#include <string.h>
+#include "ithread.h"
+#include "darksidesync_aux.h"
+#include "luaUPnPdefinitions.h"
+#include "luaUPnPpool.h"
+#include "luaUPnPrecycle.h"
+
+/*
+** ===============================================================
+**   Batched delivery of async callbacks
+** ===============================================================
+*/
+
+// Upper limit for the number of events in a single batch
+#define LPNP_MAX_BATCHSIZE 1000
+// Returned by queueDeliver if batching is disabled for the utilid
+#define LPNP_QUEUE_DISABLED 1
+
+void queueInitialize();
+void queueSetBatchSize(void* utilid, int size);
+int queueGetBatchSize(void* utilid);
+int queueDeliver(cbdelivery* mydata);
+
+/*
+** ===============================================================
+**   Event classes; limits and backpressure
+** ===============================================================
+*/
+
+// Event classes
+#define LPNP_CLASS_SSDP 0
+#define LPNP_CLASS_SOAP 1
+#define LPNP_CLASS_GENA 2
+#define LPNP_CLASS_DEVICE 3
+#define LPNP_CLASS_COUNT 4
+
+// Policies when the limit of a class is reached
+#define LPNP_POLICY_DROPOLDEST 0
+#define LPNP_POLICY_DROPNEWEST 1
+#define LPNP_POLICY_BLOCK 2
+
+int queueClassOf(Upnp_EventType EventType);
+int queueClassByName(const char* name);
+int queuePolicyByName(const char* name);
+int queueSetLimit(void* utilid, int eventclass, int limit, int policy);
+void queueResetLimits(void* utilid);
+int queueAdmit(Upnp_EventType EventType, void* cookie);
+void queueRelease(Upnp_EventType EventType, void* cookie);
+void queueStopping(int stopping);
+void queuePushStats(lua_State *L, void* utilid);
+
+#endif  /* LuaUPnPqueue_h */
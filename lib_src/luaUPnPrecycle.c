@@ -0,0 +1,156 @@
+#include "luaUPnPrecycle.h"
+
+/*
+** ===============================================================
+**   Event table recycling
+** ===============================================================
+** Opt-in, for handlers that do not keep a reference to the async event
+** tables after returning. Instead of creating a new table for each event,
+** the tables are taken from a pool of the Lua state. Each delivery (a
+** single event, a batch, or a drain of the ring) first clears the tables
+** handed out by the previous delivery and returns them to the pool, as by
+** then their handlers have returned. Requests (actions, subscriptions)
+** are not recycled.
+** The pool is a userdata in the registry, the tables are stored in its
+** environment table, at index 1 to 'size'.
+*/
+
+typedef struct _eventpool {
+	int size;		// number of tables to recycle
+	int used;		// tables handed out by the current delivery
+} eventpool;
+
+static volatile long recyclestates = 0;		// Lua states with a pool, skips lookups if 0
+static volatile long reused = 0;			// tables recycled; allocations avoided
+static volatile long created = 0;			// tables created while recycling
+
+// Returns the pool of the Lua state, or NULL. Leaves nothing on the stack.
+static eventpool* recycleGetPool(lua_State *L)
+{
+	eventpool* pool;
+	if (recyclestates == 0) return NULL;
+	lua_getfield(L, LUA_REGISTRYINDEX, LPNP_EVENTPOOL);
+	pool = (eventpool*)lua_touserdata(L, -1);
+	lua_pop(L, 1);		// anchored in the registry
+	return pool;
+}
+
+// Sets the pool size for the Lua state, 0 to disable recycling
+void recycleSetSize(lua_State *L, int size)
+{
+	eventpool* pool;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, LPNP_EVENTPOOL);
+	pool = (eventpool*)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (size == 0)
+	{
+		if (pool == NULL) return;
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LPNP_EVENTPOOL);
+		LPNP_DEC(&recyclestates);
+		return;
+	}
+	if (pool == NULL)
+	{
+		pool = (eventpool*)lua_newuserdata(L, sizeof(eventpool));
+		lua_createtable(L, size, 0);
+		lua_setfenv(L, -2);
+		lua_setfield(L, LUA_REGISTRYINDEX, LPNP_EVENTPOOL);
+		LPNP_INC(&recyclestates);
+		pool->used = 0;
+	}
+	else
+	{
+		// drop tables beyond the new size
+		lua_getfield(L, LUA_REGISTRYINDEX, LPNP_EVENTPOOL);
+		lua_getfenv(L, -1);
+		while (pool->size > size)
+		{
+			lua_pushnil(L);
+			lua_rawseti(L, -2, pool->size);
+			pool->size--;
+		}
+		lua_pop(L, 2);
+		if (pool->used > size) pool->used = size;
+	}
+	pool->size = size;
+}
+
+// Start of a delivery; returns the tables of the previous delivery to the
+// pool, after clearing them
+void recycleStart(lua_State *L)
+{
+	eventpool* pool = recycleGetPool(L);
+	int i;
+
+	if (pool == NULL || pool->used == 0) return;
+	lua_checkstack(L, 5);
+	lua_getfield(L, LUA_REGISTRYINDEX, LPNP_EVENTPOOL);
+	lua_getfenv(L, -1);
+	for (i = 1; i <= pool->used; i++)
+	{
+		lua_rawgeti(L, -1, i);
+		lua_pushnil(L);
+		while (lua_next(L, -2) != 0)
+		{
+			lua_pop(L, 1);				// pop the value
+			lua_pushvalue(L, -1);		// keep the key for the next iteration
+			lua_pushnil(L);
+			lua_rawset(L, -4);			// clearing existing fields is allowed while traversing
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 2);
+	pool->used = 0;
+}
+
+// Pushes a table for an event; a recycled one if available
+void recyclePushTable(lua_State *L, int narr, int nrec)
+{
+	eventpool* pool = recycleGetPool(L);
+
+	if (pool == NULL)
+	{
+		lua_createtable(L, narr, nrec);
+		return;
+	}
+	if (pool->used >= pool->size)
+	{
+		// pool exhausted by this delivery, this one is not recycled
+		lua_createtable(L, narr, nrec);
+		LPNP_INC(&created);
+		return;
+	}
+	lua_getfield(L, LUA_REGISTRYINDEX, LPNP_EVENTPOOL);
+	lua_getfenv(L, -1);
+	pool->used++;
+	lua_rawgeti(L, -1, pool->used);
+	if (lua_istable(L, -1))
+		LPNP_INC(&reused);
+	else
+	{
+		lua_pop(L, 1);
+		lua_createtable(L, narr, nrec);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, pool->used);
+		LPNP_INC(&created);
+	}
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+// Pushes a table with the fields 'size' (of the pool of the calling Lua
+// state, 0 if disabled), 'reused' (allocations avoided) and 'created'
+void recyclePushStats(lua_State *L)
+{
+	eventpool* pool = recycleGetPool(L);
+
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, (pool == NULL ? 0 : pool->size));
+	lua_setfield(L, -2, "size");
+	lua_pushnumber(L, (lua_Number)reused);
+	lua_setfield(L, -2, "reused");
+	lua_pushnumber(L, (lua_Number)created);
+	lua_setfield(L, -2, "created");
+}
@@ -0,0 +1,24 @@
+#ifndef LuaUPnPrecycle_h
+#define LuaUPnPrecycle_h
+
+#include <lua.h>
+#include <lauxlib.h>
+#include "luaUPnPdefinitions.h"
+
+/*
+** ===============================================================
+**   Event table recycling
+** ===============================================================
+*/
+
+// Registry key for the table pool of a Lua state
+#define LPNP_EVENTPOOL "LuaUPnP.EventPool"
+// Upper limit for the number of tables in a pool
+#define LPNP_MAX_EVENTPOOL 10000
+
+void recycleSetSize(lua_State *L, int size);
+void recycleStart(lua_State *L);
+void recyclePushTable(lua_State *L, int narr, int nrec);
+void recyclePushStats(lua_State *L);
+
+#endif  /* LuaUPnPrecycle_h */
@@ -0,0 +1,287 @@
+#include "luaUPnPring.h"
+
+/*
+** ===============================================================
+**   Lock-free ring for delivery of async callbacks
+** ===============================================================
+** Optional transport, bypassing DSS for the async events. The pupnp
+** threads (multiple producers) store the delivery records in a bounded
+** ring, the Lua thread (single consumer) drains it. No locks are used,
+** each slot carries a sequence number that tells producers and consumer
+** whether the slot is free or filled (bounded queue design by D. Vyukov).
+** The Lua side provides a UDP port on localhost to which a single byte
+** is sent when the ring goes from empty to filled, so it can be added to
+** a socket scheduler like any other socket.
+*/
+
+typedef struct _ringslot {
+	volatile long seq;
+	cbdelivery* data;
+} ringslot;
+
+typedef struct _cbring {
+	void* utilid;				// Lua state owning the ring
+	long mask;					// size - 1, size is a power of 2
+	volatile long head;			// next position to write, producers
+	long tail;					// next position to read, consumer only
+	volatile long signalled;	// 1 if a wake-up is underway
+	volatile long delivered;	// statistics
+	volatile long dropped;
+#ifdef WIN32
+	SOCKET sock;
+#else
+	int sock;
+#endif
+	struct sockaddr_in addr;	// Lua side socket to wake up
+	ringslot* slots;
+} cbring;
+
+static cbring* volatile activering = NULL;
+static volatile long ringclaimed = 0;	// 1 while a ring is being started or is active
+static volatile long ringusers = 0;		// threads currently accessing 'activering'
+
+// difference between 2 positions, safe for wrap-arounds
+#define RING_DIFF(a, b) ((long)((unsigned long)(a) - (unsigned long)(b)))
+
+// Releases the calling thread's access to the ring, see ringAcquire
+#define ringRelease() LPNP_DEC(&ringusers)
+
+// Gets access to the active ring (may be NULL), it cannot be destroyed
+// until released again by ringRelease
+static cbring* ringAcquire()
+{
+	LPNP_INC(&ringusers);
+	LPNP_BARRIER();
+	return activering;
+}
+
+static void ringCloseSocket(cbring* ring)
+{
+#ifdef WIN32
+	closesocket(ring->sock);
+#else
+	close(ring->sock);
+#endif
+}
+
+// Creates and activates the ring, events will be signalled to the
+// localhost UDP 'port'. The size will be rounded up to a power of 2.
+// Returns a UPnP error code.
+int ringStart(void* utilid, unsigned short port, int size)
+{
+	cbring* ring;
+	long i, slots = 1;
+
+	if (size < 1 || size > LPNP_MAX_RINGSIZE || port == 0) return UPNP_E_INVALID_PARAM;
+	if (!LPNP_CAS(&ringclaimed, 0, 1)) return UPNP_E_INVALID_PARAM;	// already started
+	while (slots < size) slots = slots * 2;
+
+	ring = (cbring*)malloc(sizeof(cbring));
+	if (ring == NULL)
+	{
+		ringclaimed = 0;
+		return UPNP_E_OUTOF_MEMORY;
+	}
+	ring->slots = (ringslot*)malloc(sizeof(ringslot) * slots);
+	if (ring->slots == NULL)
+	{
+		free(ring);
+		ringclaimed = 0;
+		return UPNP_E_OUTOF_MEMORY;
+	}
+	for (i = 0; i < slots; i++)
+	{
+		ring->slots[i].seq = i;
+		ring->slots[i].data = NULL;
+	}
+	ring->utilid = utilid;
+	ring->mask = slots - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->signalled = 0;
+	ring->delivered = 0;
+	ring->dropped = 0;
+
+	ring->sock = socket(AF_INET, SOCK_DGRAM, 0);
+#ifdef WIN32
+	if (ring->sock == INVALID_SOCKET)
+#else
+	if (ring->sock < 0)
+#endif
+	{
+		free(ring->slots);
+		free(ring);
+		ringclaimed = 0;
+		return UPNP_E_SOCKET_ERROR;
+	}
+	memset(&ring->addr, 0, sizeof(ring->addr));
+	ring->addr.sin_family = AF_INET;
+	ring->addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	ring->addr.sin_port = htons(port);
+
+	LPNP_BARRIER();
+	activering = ring;
+	return UPNP_E_SUCCESS;
+}
+
+// Wakes up the Lua side, only if not already signalled
+static void ringSignal(cbring* ring)
+{
+	char signal = 1;
+	if (LPNP_CAS(&ring->signalled, 0, 1))
+		sendto(ring->sock, &signal, 1, 0, (struct sockaddr*)&ring->addr, sizeof(ring->addr));
+}
+
+// Pops a record, consumer only. Returns NULL if the ring is empty.
+static cbdelivery* ringPop(cbring* ring)
+{
+	cbdelivery* data;
+	ringslot* slot = &ring->slots[ring->tail & ring->mask];
+	long seq = slot->seq;
+
+	LPNP_BARRIER();
+	if (RING_DIFF(seq, ring->tail + 1) < 0) return NULL;	// not filled yet
+	data = slot->data;
+	slot->data = NULL;
+	LPNP_BARRIER();
+	slot->seq = ring->tail + ring->mask + 1;	// mark free for the next round
+	ring->tail += 1;
+	return data;
+}
+
+// Deactivates and destroys the ring if it is owned by 'utilid', remaining
+// records are released. Waits for producers still storing records.
+void ringStop(void* utilid)
+{
+	cbring* ring = activering;
+	cbdelivery* data;
+
+	if (ring == NULL || ring->utilid != utilid) return;
+	activering = NULL;
+	LPNP_BARRIER();
+	while (ringusers != 0)		// wait for threads that got the ring before it was deactivated
+	{
+#ifdef WIN32
+		Sleep(0);
+#else
+		sched_yield();
+#endif
+	}
+	while ((data = ringPop(ring)) != NULL) data->Decode(NULL, data);
+	ringCloseSocket(ring);
+	free(ring->slots);
+	free(ring);
+	LPNP_BARRIER();
+	ringclaimed = 0;
+}
+
+// Stores a record in the ring and wakes up the Lua side if required.
+// Returns DSS_SUCCESS, LPNP_RING_DISABLED if the ring is not in use for the
+// cookie of the record, or LPNP_RING_FULL. In the last 2 cases the record
+// remains owned by the caller.
+int ringDeliver(cbdelivery* mydata)
+{
+	cbring* ring = ringAcquire();
+	ringslot* slot;
+	long pos, dif;
+
+	if (ring == NULL || ring->utilid != mydata->Cookie)
+	{
+		ringRelease();
+		return LPNP_RING_DISABLED;
+	}
+
+	// claim a slot
+	pos = ring->head;
+	while (1)
+	{
+		slot = &ring->slots[pos & ring->mask];
+		dif = RING_DIFF(slot->seq, pos);
+		if (dif == 0)
+		{
+			if (LPNP_CAS(&ring->head, pos, pos + 1)) break;	// claimed
+			pos = ring->head;
+		}
+		else if (dif < 0)
+		{
+			LPNP_INC(&ring->dropped);
+			ringRelease();
+			return LPNP_RING_FULL;
+		}
+		else
+			pos = ring->head;	// another producer was first, retry
+	}
+	// fill it and publish
+	slot->data = mydata;
+	LPNP_BARRIER();
+	slot->seq = pos + 1;
+	LPNP_INC(&ring->delivered);
+
+	ringSignal(ring);
+
+	ringRelease();
+	return DSS_SUCCESS;
+}
+
+// Drains the ring; pushes an array of event tables (with field 'n') on
+// the stack. 'utilid' must be the one of the calling Lua state, only the
+// owner of the ring may drain it. At most LPNP_RING_DRAINLIMIT records are
+// taken, so a flood of events does not starve the Lua side; if the limit
+// is reached the Lua side is signalled again for the remainder.
+// Returns DSS_SUCCESS, or LPNP_RING_DISABLED (nothing pushed) if the ring
+// is not owned by 'utilid'.
+int ringDrain(lua_State *L, void* utilid)
+{
+	cbring* ring = activering;	// only the owner (the caller) can destroy it
+	cbdelivery* data;
+	int i = 0;
+	int popped = 0;
+
+	if (ring == NULL || utilid == NULL || ring->utilid != utilid) return LPNP_RING_DISABLED;
+
+	recycleStart(L);	// the event tables of the previous delivery are no longer used
+	lua_newtable(L);
+	// reset the signal first, so records added while draining will
+	// trigger a new wake-up
+	ring->signalled = 0;
+	LPNP_BARRIER();
+	while (popped < LPNP_RING_DRAINLIMIT && (data = ringPop(ring)) != NULL)
+	{
+		popped += 1;
+		if (data->Decode(L, data))		// pushes table and releases record
+		{
+			i += 1;
+			lua_rawseti(L, -2, i);
+		}
+	}
+	if (popped == LPNP_RING_DRAINLIMIT) ringSignal(ring);	// there may be more, come back for it
+	lua_pushinteger(L, i);
+	lua_setfield(L, -2, "n");
+	return DSS_SUCCESS;
+}
+
+// Pushes a table with the ring statistics, or nil if the ring is not active
+void ringPushStats(lua_State *L)
+{
+	cbring* ring = ringAcquire();
+	long size, delivered, dropped;
+
+	if (ring == NULL)
+	{
+		ringRelease();
+		lua_pushnil(L);
+		return;
+	}
+	size = ring->mask + 1;
+	delivered = ring->delivered;
+	dropped = ring->dropped;
+	ringRelease();
+
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, (int)size);
+	lua_setfield(L, -2, "size");
+	lua_pushnumber(L, (lua_Number)delivered);
+	lua_setfield(L, -2, "delivered");
+	lua_pushnumber(L, (lua_Number)dropped);
+	lua_setfield(L, -2, "dropped");
+}
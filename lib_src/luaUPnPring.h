@@ -0,0 +1,41 @@
+#ifndef LuaUPnPring_h
+#define LuaUPnPring_h
+
+#include <lua.h>
+#include <string.h>
+#ifdef WIN32
+	#include <winsock2.h>
+#else
+	#include <sys/types.h>
+	#include <sys/socket.h>
+	#include <netinet/in.h>
+	#include <arpa/inet.h>
+	#include <unistd.h>
+	#include <sched.h>
+#endif
+#include "darksidesync_aux.h"
+#include "luaUPnPdefinitions.h"
+#include "luaUPnPrecycle.h"
+
+/*
+** ===============================================================
+**   Lock-free ring for delivery of async callbacks
+** ===============================================================
+*/
+
+// Upper limit for the number of slots in the ring
+#define LPNP_MAX_RINGSIZE 65536
+// Max number of records taken from the ring by a single drain
+#define LPNP_RING_DRAINLIMIT 256
+// Returned by ringDeliver if the ring is not active for the utilid
+#define LPNP_RING_DISABLED 2
+// Returned by ringDeliver if the ring is full, and the event was not queued
+#define LPNP_RING_FULL 3
+
+int ringStart(void* utilid, unsigned short port, int size);
+void ringStop(void* utilid);
+int ringDeliver(cbdelivery* mydata);
+int ringDrain(lua_State *L, void* utilid);
+void ringPushStats(lua_State *L);
+
+#endif  /* LuaUPnPring_h */
@@ -0,0 +1,291 @@
+#include "luaUPnPshard.h"
+
+/*
+** ===============================================================
+**   Lua states sharing the UPnP stack
+** ===============================================================
+** The UPnP stack is process wide, but each Lua state (for example one
+** per OS thread) can start it and register its own devices and clients.
+** pupnp hands every callback the cookie provided when the handle was
+** registered, being the DSS utilid of the registering Lua state, so
+** callbacks are routed to the state owning the device or client. Actions
+** on independent devices hence execute in parallel.
+** The first state to start initializes the stack (and determines its
+** address and port), the last one to stop finishes it. A state stopping
+** earlier only unregisters its own handles.
+*/
+
+typedef struct _shardhandle {
+	int handle;
+	int isdevice;
+	struct _shardhandle* next;
+} shardhandle;
+
+typedef struct _shard {
+	void* utilid;
+	shardhandle* handles;
+	struct _shard* next;
+} shard;
+
+static shard* shards = NULL;
+static int shardcount = 0;
+static DSS_cancel_1v0_t shardcancel = NULL;
+static ithread_mutex_t shardlock;
+
+void shardInitialize()
+{
+	ithread_mutex_init(&shardlock, NULL);
+}
+
+// Looks up a shard by utilid, requires the lock
+static shard* shardFind(void* utilid, shard*** link)
+{
+	shard** s = &shards;
+	while (*s != NULL && (*s)->utilid != utilid) s = &(*s)->next;
+	if (link != NULL) *link = s;
+	return *s;
+}
+
+// Registers with DSS in protected mode, so the lock can be released on
+// errors. Pushes the utilid as a lightuserdata.
+static int shardRegister(lua_State *L)
+{
+	DSS_initialize(L, shardcancel);		// will not return on error.
+	lua_pushlightuserdata(L, DSS_getutilid(L));
+	return 1;
+}
+
+// Starts the UPnP stack for a Lua state. Initializes it if this is the
+// first state, otherwise 'ipaddr' and 'port' are ignored. Returns a UPnP
+// error code, or UPNP_E_INIT if the state was already started. Raises a
+// Lua error if DSS registration fails.
+int shardStart(lua_State *L, DSS_cancel_1v0_t pCancel, const char* ipaddr, unsigned short port)
+{
+	void* utilid;
+	shard* s;
+	int result = UPNP_E_SUCCESS;
+
+	ithread_mutex_lock(&shardlock);
+	lua_getfield(L, LUA_REGISTRYINDEX, LPNP_SHARD_UTILID);
+	utilid = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (utilid != NULL && shardFind(utilid, NULL) != NULL)
+	{
+		ithread_mutex_unlock(&shardlock);
+		return UPNP_E_INIT;
+	}
+
+	s = (shard*)malloc(sizeof(shard));
+	if (s == NULL)
+	{
+		ithread_mutex_unlock(&shardlock);
+		return UPNP_E_OUTOF_MEMORY;
+	}
+
+	// first register with DSS
+	shardcancel = pCancel;
+	lua_pushcfunction(L, &shardRegister);
+	if (lua_pcall(L, 0, 1, 0) != 0)
+	{
+		ithread_mutex_unlock(&shardlock);
+		free(s);
+		lua_error(L);
+	}
+	utilid = lua_touserdata(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LPNP_SHARD_UTILID);
+
+	if (shardcount == 0)
+	{
+		queueStopping(FALSE);
+		result = UpnpInit(ipaddr, port);
+		if (result != UPNP_E_SUCCESS)
+		{
+			DSS_shutdown(NULL, utilid);		// shutdown DSS again
+			lua_pushnil(L);
+			lua_setfield(L, LUA_REGISTRYINDEX, LPNP_SHARD_UTILID);
+			ithread_mutex_unlock(&shardlock);
+			free(s);
+			return result;
+		}
+		UPnPStarted = TRUE;
+	}
+	s->utilid = utilid;
+	s->handles = NULL;
+	s->next = shards;
+	shards = s;
+	shardcount += 1;
+	ithread_mutex_unlock(&shardlock);
+	return result;
+}
+
+// Stops the UPnP stack for a Lua state, either by Lua state, or by utilid
+// if L == NULL (DSS cancelling). The handles of the state are unregistered,
+// the stack itself is finished when the last state stops. Returns a UPnP
+// error code, UPNP_E_FINISH if the state was not started.
+int shardStop(lua_State *L, void* utilid)
+{
+	shard* s;
+	shard** link;
+	shardhandle* h;
+	int result = UPNP_E_SUCCESS;
+
+	if (L != NULL)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, LPNP_SHARD_UTILID);
+		utilid = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		lua_pushnil(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, LPNP_SHARD_UTILID);
+	}
+	if (utilid == NULL) return UPNP_E_FINISH;
+
+	ithread_mutex_lock(&shardlock);
+	s = shardFind(utilid, &link);
+	if (s == NULL)
+	{
+		ithread_mutex_unlock(&shardlock);
+		return UPNP_E_FINISH;
+	}
+	*link = s->next;
+	shardcount -= 1;
+
+	if (shardcount == 0) queueStopping(TRUE);		// release threads blocked on queue limits
+	DSS_shutdown(NULL, utilid);		// unregister first to release all waiting threads
+	ringStop(utilid);				// the ring is only drained by its owner
+	callbackResetOptions(utilid);	// the utilid may be reused by another state
+	queueResetLimits(utilid);
+	dedupClear(utilid);
+
+	if (shardcount == 0)
+	{
+		result = UpnpFinish();		// stop UPnP threads
+		UPnPStarted = FALSE;
+	}
+	while (s->handles != NULL)
+	{
+		h = s->handles;
+		s->handles = h->next;
+		if (h->isdevice)
+		{
+			if (shardcount != 0) UpnpUnRegisterRootDevice(h->handle);
+			storeRemove(h->handle);
+		}
+		else
+		{
+			if (shardcount != 0) UpnpUnRegisterClient(h->handle);
+		}
+		free(h);
+	}
+	free(s);
+	ithread_mutex_unlock(&shardlock);
+	return result;
+}
+
+// Returns the number of started Lua states
+int shardCount()
+{
+	int count;
+	ithread_mutex_lock(&shardlock);
+	count = shardcount;
+	ithread_mutex_unlock(&shardlock);
+	return count;
+}
+
+// Returns the utilid of a started Lua state, or NULL if not started.
+// Unlike DSS_getutilid it does not raise errors, so it is safe for GC methods.
+void* shardGetUtilid(lua_State *L)
+{
+	void* utilid;
+	lua_getfield(L, LUA_REGISTRYINDEX, LPNP_SHARD_UTILID);
+	utilid = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return utilid;
+}
+
+// Records a device or client handle registered by a Lua state
+void shardAddHandle(void* utilid, int handle, int isdevice)
+{
+	shard* s;
+	shardhandle* h = (shardhandle*)malloc(sizeof(shardhandle));
+
+	if (h == NULL) return;	// only used for cleanup on stopping
+	h->handle = handle;
+	h->isdevice = isdevice;
+	ithread_mutex_lock(&shardlock);
+	s = shardFind(utilid, NULL);
+	if (s != NULL)
+	{
+		h->next = s->handles;
+		s->handles = h;
+		h = NULL;
+	}
+	ithread_mutex_unlock(&shardlock);
+	if (h != NULL) free(h);
+}
+
+// Removes a handle from the handles registered by the Lua state 'utilid'.
+// Returns TRUE if it was found, and hence is still registered with pupnp
+// and must be unregistered by the caller. Handles of other states are never
+// matched, pupnp may hand out the same handle again after unregistering.
+int shardRemoveHandle(void* utilid, int handle, int isdevice)
+{
+	shard* s;
+	shardhandle** h;
+	shardhandle* found = NULL;
+
+	if (utilid == NULL) return FALSE;
+	ithread_mutex_lock(&shardlock);
+	s = shardFind(utilid, NULL);
+	if (s != NULL)
+	{
+		for (h = &s->handles; *h != NULL; h = &(*h)->next)
+		{
+			if ((*h)->handle == handle && (*h)->isdevice == isdevice)
+			{
+				found = *h;
+				*h = found->next;
+				break;
+			}
+		}
+	}
+	ithread_mutex_unlock(&shardlock);
+	if (found == NULL) return FALSE;
+	free(found);
+	return TRUE;
+}
+
+// Pushes a table with the number of started Lua states, and the number of
+// handles registered by the calling state
+void shardPushStats(lua_State *L)
+{
+	shard* s;
+	shardhandle* h;
+	void* utilid;
+	int devices = 0;
+	int clients = 0;
+	int count;
+
+	utilid = shardGetUtilid(L);
+
+	ithread_mutex_lock(&shardlock);
+	count = shardcount;
+	s = (utilid == NULL ? NULL : shardFind(utilid, NULL));
+	if (s != NULL)
+	{
+		for (h = s->handles; h != NULL; h = h->next)
+		{
+			if (h->isdevice) devices++; else clients++;
+		}
+	}
+	ithread_mutex_unlock(&shardlock);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, count);
+	lua_setfield(L, -2, "states");
+	lua_pushboolean(L, s != NULL);
+	lua_setfield(L, -2, "started");
+	lua_pushinteger(L, devices);
+	lua_setfield(L, -2, "devices");
+	lua_pushinteger(L, clients);
+	lua_setfield(L, -2, "clients");
+}
@@ -0,0 +1,35 @@
+#ifndef LuaUPnPshard_h
+#define LuaUPnPshard_h
+
+#include <lua.h>
+#include <lauxlib.h>
+#include <stdlib.h>
+#include "ithread.h"
+#include "upnp.h"
+#include "darksidesync_aux.h"
+#include "luaUPnPdefinitions.h"
+#include "luaUPnPqueue.h"
+#include "luaUPnPring.h"
+#include "luaUPnPstore.h"
+#include "luaUPnPcallback.h"
+#include "luaUPnPdedup.h"
+
+/*
+** ===============================================================
+**   Lua states sharing the UPnP stack
+** ===============================================================
+*/
+
+// Registry key with the utilid (lightuserdata) of a started Lua state
+#define LPNP_SHARD_UTILID "LuaUPnP.utilid"
+
+void shardInitialize();
+int shardStart(lua_State *L, DSS_cancel_1v0_t pCancel, const char* ipaddr, unsigned short port);
+int shardStop(lua_State *L, void* utilid);
+int shardCount();
+void* shardGetUtilid(lua_State *L);
+void shardAddHandle(void* utilid, int handle, int isdevice);
+int shardRemoveHandle(void* utilid, int handle, int isdevice);
+void shardPushStats(lua_State *L);
+
+#endif  /* LuaUPnPshard_h */
@@ -0,0 +1,411 @@
+#include "luaUPnPstore.h"
+
+/*
+** ===============================================================
+**   Native state store
+** ===============================================================
+** A C side mirror of the statevariable values of the devices, kept up
+** to date by the Lua side whenever a value is set. It is used to answer
+** getter actions (those using 'action.genericgetter') and to accept
+** subscriptions (initial property set) directly on the pupnp thread,
+** without blocking on the Lua thread.
+** Only the evented variables, and the variables related to the getter
+** actions, are stored. Requests for anything not in the store are
+** delivered to Lua as usual.
+*/
+
+typedef struct _storevar {
+	struct _storevar* next;
+	int evented;
+	char* value;				// current value in UPnP format
+	char name[1];				// allocated beyond struct
+} storevar;
+
+typedef struct _storegetter {
+	struct _storegetter* next;
+	int count;					// number of 'out' arguments
+	char** args;				// argument names
+	storevar** vars;			// related statevariable for each argument
+	char name[1];				// action name, allocated beyond struct
+} storegetter;
+
+typedef struct _storeservice {
+	struct _storeservice* next;
+	UpnpDevice_Handle handle;	// handle of the root device
+	char* udn;
+	char* serviceid;
+	storevar* vars;				// in order of addition
+	storegetter* getters;
+} storeservice;
+
+static storeservice* services = NULL;
+static volatile int storeused = FALSE;		// services != NULL, set while holding the lock
+static unsigned long answered = 0;
+static unsigned long accepted = 0;
+static ithread_mutex_t storelock;
+
+void storeInitialize()
+{
+	ithread_mutex_init(&storelock, NULL);
+}
+
+static char* storeStrdup(const char* str)
+{
+	char* copy = (char*)malloc(strlen(str) + 1);
+	if (copy != NULL) strcpy(copy, str);
+	return copy;
+}
+
+// Action names are matched case insensitive, like the Lua side does
+static int storeSameName(const char* a, const char* b)
+{
+	while (*a != 0 && tolower((unsigned char)*a) == tolower((unsigned char)*b))
+	{
+		a++;
+		b++;
+	}
+	return tolower((unsigned char)*a) == tolower((unsigned char)*b);
+}
+
+// Must be called while holding the lock
+static storeservice* storeFindService(const char* udn, const char* serviceid)
+{
+	storeservice* svc = services;
+	if (udn == NULL || serviceid == NULL) return NULL;
+	while (svc != NULL && (strcmp(svc->serviceid, serviceid) != 0 || strcmp(svc->udn, udn) != 0)) svc = svc->next;
+	return svc;
+}
+
+// Must be called while holding the lock
+static storevar* storeFindVariable(storeservice* svc, const char* name)
+{
+	storevar* var = svc->vars;
+	while (var != NULL && strcmp(var->name, name) != 0) var = var->next;
+	return var;
+}
+
+static void storeFreeGetter(storegetter* getter)
+{
+	int i;
+	for (i = 0; i < getter->count; i++) free(getter->args[i]);
+	free(getter->args);
+	free(getter->vars);
+	free(getter);
+}
+
+static void storeFreeService(storeservice* svc)
+{
+	storevar* var;
+	storegetter* getter;
+	while (svc->vars != NULL)
+	{
+		var = svc->vars;
+		svc->vars = var->next;
+		free(var->value);
+		free(var);
+	}
+	while (svc->getters != NULL)
+	{
+		getter = svc->getters;
+		svc->getters = getter->next;
+		storeFreeGetter(getter);
+	}
+	free(svc->udn);
+	free(svc->serviceid);
+	free(svc);
+}
+
+// Adds a variable to the store (or updates it if it exists), the service is
+// created if required. Returns a UPnP error code.
+int storeAddVariable(UpnpDevice_Handle handle, const char* udn, const char* serviceid, const char* name, const char* value, int evented)
+{
+	storeservice* svc;
+	storevar* var;
+	storevar** link;
+	char* copy = storeStrdup(value);
+
+	if (copy == NULL) return UPNP_E_OUTOF_MEMORY;
+	ithread_mutex_lock(&storelock);
+	svc = storeFindService(udn, serviceid);
+	if (svc == NULL)
+	{
+		svc = (storeservice*)malloc(sizeof(storeservice));
+		if (svc != NULL)
+		{
+			svc->handle = handle;
+			svc->udn = storeStrdup(udn);
+			svc->serviceid = storeStrdup(serviceid);
+			svc->vars = NULL;
+			svc->getters = NULL;
+			if (svc->udn == NULL || svc->serviceid == NULL)
+			{
+				storeFreeService(svc);
+				svc = NULL;
+			}
+			else
+			{
+				svc->next = services;
+				services = svc;
+				storeused = TRUE;
+			}
+		}
+	}
+	if (svc == NULL)
+	{
+		ithread_mutex_unlock(&storelock);
+		free(copy);
+		return UPNP_E_OUTOF_MEMORY;
+	}
+	var = storeFindVariable(svc, name);
+	if (var == NULL)
+	{
+		var = (storevar*)malloc(sizeof(storevar) + strlen(name));
+		if (var == NULL)
+		{
+			ithread_mutex_unlock(&storelock);
+			free(copy);
+			return UPNP_E_OUTOF_MEMORY;
+		}
+		strcpy(var->name, name);
+		var->value = NULL;
+		var->next = NULL;
+		// append, to keep the order of the service description
+		link = &svc->vars;
+		while (*link != NULL) link = &(*link)->next;
+		*link = var;
+	}
+	var->evented = evented;
+	free(var->value);
+	var->value = copy;
+	ithread_mutex_unlock(&storelock);
+	return UPNP_E_SUCCESS;
+}
+
+// Updates the value of a stored variable.
+// Returns TRUE if updated, FALSE if the variable is not in the store.
+int storeSetVariable(const char* udn, const char* serviceid, const char* name, const char* value)
+{
+	storeservice* svc;
+	storevar* var = NULL;
+	char* copy = storeStrdup(value);
+	char* old = NULL;
+
+	if (copy == NULL) return FALSE;
+	ithread_mutex_lock(&storelock);
+	svc = storeFindService(udn, serviceid);
+	if (svc != NULL) var = storeFindVariable(svc, name);
+	if (var != NULL)
+	{
+		old = var->value;
+		var->value = copy;
+		copy = NULL;
+	}
+	ithread_mutex_unlock(&storelock);
+	free(old);
+	free(copy);
+	return (var != NULL);
+}
+
+// Adds a getter action, 'args' are the names of the 'out' arguments, 'vars' the
+// names of their related statevariables, which must have been added already.
+// Returns a UPnP error code.
+int storeAddGetter(const char* udn, const char* serviceid, const char* action, int count, const char** args, const char** vars)
+{
+	storeservice* svc;
+	storegetter* getter;
+	storegetter** link;
+	int i;
+	int result = UPNP_E_SUCCESS;
+
+	getter = (storegetter*)malloc(sizeof(storegetter) + strlen(action));
+	if (getter == NULL) return UPNP_E_OUTOF_MEMORY;
+	strcpy(getter->name, action);
+	getter->count = 0;
+	getter->args = (char**)malloc(sizeof(char*) * (count + 1));
+	getter->vars = (storevar**)malloc(sizeof(storevar*) * (count + 1));
+	if (getter->args == NULL || getter->vars == NULL)
+	{
+		storeFreeGetter(getter);
+		return UPNP_E_OUTOF_MEMORY;
+	}
+
+	ithread_mutex_lock(&storelock);
+	svc = storeFindService(udn, serviceid);
+	if (svc == NULL) result = UPNP_E_INVALID_SERVICE;
+	for (i = 0; i < count && result == UPNP_E_SUCCESS; i++)
+	{
+		getter->vars[i] = storeFindVariable(svc, vars[i]);
+		getter->args[i] = storeStrdup(args[i]);
+		if (getter->args[i] != NULL) getter->count = i + 1;
+		if (getter->vars[i] == NULL)
+			result = UPNP_E_INVALID_PARAM;
+		else if (getter->args[i] == NULL)
+			result = UPNP_E_OUTOF_MEMORY;
+	}
+	if (result == UPNP_E_SUCCESS)
+	{
+		// replace an existing one
+		link = &svc->getters;
+		while (*link != NULL && !storeSameName((*link)->name, action)) link = &(*link)->next;
+		if (*link != NULL)
+		{
+			getter->next = (*link)->next;
+			storeFreeGetter(*link);
+		}
+		else
+			getter->next = NULL;
+		*link = getter;
+	}
+	ithread_mutex_unlock(&storelock);
+	if (result != UPNP_E_SUCCESS) storeFreeGetter(getter);
+	return result;
+}
+
+// Removes all services of a root device from the store
+void storeRemove(UpnpDevice_Handle handle)
+{
+	storeservice** link;
+	storeservice* svc;
+
+	ithread_mutex_lock(&storelock);
+	link = &services;
+	while (*link != NULL)
+	{
+		svc = *link;
+		if (svc->handle == handle)
+		{
+			*link = svc->next;
+			storeFreeService(svc);
+		}
+		else
+			link = &svc->next;
+	}
+	storeused = (services != NULL);
+	ithread_mutex_unlock(&storelock);
+}
+
+// Answers an action request if it is a getter in the store.
+// Returns TRUE if answered, FALSE if it must be delivered to Lua.
+int storeAnswerAction(UpnpActionRequest *arEvent)
+{
+	storeservice* svc;
+	storegetter* getter = NULL;
+	IXML_Document* RetList = NULL;
+	IXML_Node* ActionNameNode = NULL;
+	const char* ServiceType = NULL;
+	const char* ActionName = UpnpString_get_String(UpnpActionRequest_get_ActionName(arEvent));
+	xmlbuffer b;
+	int i;
+	int err = UPNP_E_SUCCESS;
+
+	if (!storeused || ActionName == NULL) return FALSE;	// quick check without locking
+
+	// Get the ServiceType from the ActionRequest XML
+	ActionNameNode = ixmlNode_getFirstChild((IXML_Node*)UpnpActionRequest_get_ActionRequest(arEvent));
+	if (ActionNameNode != NULL) ServiceType = ixmlNode_getNamespaceURI(ActionNameNode);
+
+	ithread_mutex_lock(&storelock);
+	svc = storeFindService(UpnpString_get_String(UpnpActionRequest_get_DevUDN(arEvent)),
+		UpnpString_get_String(UpnpActionRequest_get_ServiceID(arEvent)));
+	if (svc != NULL)
+	{
+		getter = svc->getters;
+		while (getter != NULL && !storeSameName(getter->name, ActionName)) getter = getter->next;
+	}
+	if (getter == NULL)
+	{
+		ithread_mutex_unlock(&storelock);
+		return FALSE;
+	}
+	xmlInit(&b, 256);
+	xmlStartActionResponse(&b, ActionName, ServiceType);
+	for (i = 0; i < getter->count; i++)
+		xmlAddArgument(&b, getter->args[i], getter->vars[i]->value, strlen(getter->vars[i]->value));
+	xmlEndActionResponse(&b, ActionName);
+	ithread_mutex_unlock(&storelock);
+	err = xmlParse(&b, &RetList);
+
+	if (err != UPNP_E_SUCCESS) return FALSE;	// failed, leave it to Lua
+	ithread_mutex_lock(&storelock);
+	answered += 1;
+	ithread_mutex_unlock(&storelock);
+	UpnpActionRequest_set_ActionResult(arEvent, RetList);
+	UpnpActionRequest_set_ErrCode(arEvent, UPNP_E_SUCCESS);
+	return TRUE;
+}
+
+// Accepts a subscription with the evented variables of the service, if the
+// service is in the store.
+// Returns TRUE if handled, FALSE if it must be delivered to Lua.
+int storeAcceptSubscription(const UpnpSubscriptionRequest *srEvent)
+{
+	storeservice* svc;
+	storevar* var;
+	IXML_Document* VarList = NULL;
+	UpnpDevice_Handle handle = -1;
+	xmlbuffer b;
+	int err = UPNP_E_SUCCESS;
+
+	if (!storeused) return FALSE;	// quick check without locking
+
+	ithread_mutex_lock(&storelock);
+	svc = storeFindService(UpnpSubscriptionRequest_get_UDN_cstr(srEvent),
+		UpnpString_get_String(UpnpSubscriptionRequest_get_ServiceId(srEvent)));
+	if (svc == NULL)
+	{
+		ithread_mutex_unlock(&storelock);
+		return FALSE;
+	}
+	handle = svc->handle;
+	xmlInit(&b, 512);
+	xmlStartPropertySet(&b);
+	for (var = svc->vars; var != NULL; var = var->next)
+	{
+		if (var->evented) xmlAddProperty(&b, var->name, var->value, strlen(var->value));
+	}
+	xmlEndPropertySet(&b);
+	ithread_mutex_unlock(&storelock);
+
+	err = xmlParse(&b, &VarList);
+	if (err != UPNP_E_SUCCESS) return FALSE;	// failed, leave it to Lua
+	ithread_mutex_lock(&storelock);
+	accepted += 1;
+	ithread_mutex_unlock(&storelock);
+	UpnpAcceptSubscriptionExt(handle,
+			UpnpSubscriptionRequest_get_UDN_cstr(srEvent),
+			UpnpString_get_String(UpnpSubscriptionRequest_get_ServiceId(srEvent)),
+			VarList,
+			UpnpSubscriptionRequest_get_SID_cstr(srEvent));
+	ixmlDocument_free(VarList);
+	return TRUE;
+}
+
+// Pushes a table with the store counters
+void storePushStats(lua_State *L)
+{
+	storeservice* svc;
+	storevar* var;
+	int servicecount = 0;
+	int varcount = 0;
+	unsigned long stats[2];
+
+	ithread_mutex_lock(&storelock);
+	for (svc = services; svc != NULL; svc = svc->next)
+	{
+		servicecount += 1;
+		for (var = svc->vars; var != NULL; var = var->next) varcount += 1;
+	}
+	stats[0] = answered;
+	stats[1] = accepted;
+	ithread_mutex_unlock(&storelock);
+
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, servicecount);
+	lua_setfield(L, -2, "services");
+	lua_pushinteger(L, varcount);
+	lua_setfield(L, -2, "variables");
+	lua_pushnumber(L, (lua_Number)stats[0]);
+	lua_setfield(L, -2, "answered");
+	lua_pushnumber(L, (lua_Number)stats[1]);
+	lua_setfield(L, -2, "accepted");
+}
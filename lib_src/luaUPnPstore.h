@@ -0,0 +1,27 @@
+#ifndef LuaUPnPstore_h
+#define LuaUPnPstore_h
+
+#include <lua.h>
+#include <ctype.h>
+#include <string.h>
+#include "ithread.h"
+#include "upnptools.h"
+#include "luaUPnPxml.h"
+#include "luaUPnPdefinitions.h"
+
+/*
+** ===============================================================
+**   Native state store
+** ===============================================================
+*/
+
+void storeInitialize();
+int storeAddVariable(UpnpDevice_Handle handle, const char* udn, const char* serviceid, const char* name, const char* value, int evented);
+int storeSetVariable(const char* udn, const char* serviceid, const char* name, const char* value);
+int storeAddGetter(const char* udn, const char* serviceid, const char* action, int count, const char** args, const char** vars);
+void storeRemove(UpnpDevice_Handle handle);
+int storeAnswerAction(UpnpActionRequest *arEvent);
+int storeAcceptSubscription(const UpnpSubscriptionRequest *srEvent);
+void storePushStats(lua_State *L);
+
+#endif  /* LuaUPnPstore_h */
@@ -261,7 +261,13 @@ int L_clienttostring(lua_State *L)
 int L_DestroyDevice(lua_State *L)
 {
 	pLuaDevice dev = (pLuaDevice)lua_touserdata(L, 1);
-	if (UPnPStarted)	UpnpUnRegisterRootDevice(dev->device);
+	// unregister only if still registered by this Lua state, after stopping
+	// the handle is gone (or might have been reused by another state)
+	if (shardRemoveHandle(shardGetUtilid(L), dev->device, TRUE))
+	{
+		UpnpUnRegisterRootDevice(dev->device);
+		storeRemove(dev->device);
+	}
 	return 0;
 }
 
@@ -269,6 +275,8 @@ int L_DestroyDevice(lua_State *L)
 int L_DestroyClient(lua_State *L)
 {
 	pLuaClient client = (pLuaClient)lua_touserdata(L, 1);
-	if (UPnPStarted)	UpnpUnRegisterClient(client->client);
+	// unregister only if still registered by this Lua state
+	if (shardRemoveHandle(shardGetUtilid(L), client->client, FALSE))
+		UpnpUnRegisterClient(client->client);
 	return 0;
 }
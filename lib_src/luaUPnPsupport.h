@@ -7,6 +7,7 @@
 #include "luaIXML.h"
 #include "upnptools.h"
 #include "luaUPnPdefinitions.h"
+#include "luaUPnPshard.h"
 
 /*
 ** ===============================================================
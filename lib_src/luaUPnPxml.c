@@ -0,0 +1,220 @@
+#include "luaUPnPxml.h"
+
+/*
+** ===============================================================
+**   XML serializer for action responses and property sets
+** ===============================================================
+** Builds the XML text of an action response or a GENA property set
+** in a single buffer, which is then parsed once. This replaces calling
+** UpnpAddToActionResponse/UpnpAddToPropertySet for each argument, which
+** walk and extend the DOM on every call. The resulting documents are the
+** same as the ones created by pupnp.
+*/
+
+#define XML_PROPERTYSET_START "<e:propertyset xmlns:e=\"urn:schemas-upnp-org:event-1-0\">"
+#define XML_PROPERTYSET_END "</e:propertyset>"
+#define XML_PROPERTY_START "<e:property>"
+#define XML_PROPERTY_END "</e:property>"
+
+void xmlInit(xmlbuffer* b, size_t hint)
+{
+	b->len = 0;
+	b->size = (hint < 64 ? 64 : hint);
+	b->data = (char*)malloc(b->size);
+	b->err = (b->data == NULL ? UPNP_E_OUTOF_MEMORY : UPNP_E_SUCCESS);
+}
+
+void xmlFree(xmlbuffer* b)
+{
+	if (b->data != NULL) free(b->data);
+	b->data = NULL;
+	b->len = 0;
+	b->size = 0;
+}
+
+// Makes sure 'extra' bytes (plus a terminating '\0') fit in the buffer
+static int xmlReserve(xmlbuffer* b, size_t extra)
+{
+	char* data;
+	size_t size;
+
+	if (b->err != UPNP_E_SUCCESS) return FALSE;
+	if (b->len + extra < b->size) return TRUE;
+	size = b->size * 2;
+	while (b->len + extra >= size) size = size * 2;
+	data = (char*)realloc(b->data, size);
+	if (data == NULL)
+	{
+		b->err = UPNP_E_OUTOF_MEMORY;
+		return FALSE;
+	}
+	b->data = data;
+	b->size = size;
+	return TRUE;
+}
+
+static void xmlAdd(xmlbuffer* b, const char* s, size_t len)
+{
+	if (!xmlReserve(b, len)) return;
+	memcpy(b->data + b->len, s, len);
+	b->len += len;
+}
+
+static void xmlAddString(xmlbuffer* b, const char* s)
+{
+	xmlAdd(b, s, strlen(s));
+}
+
+// Adds text, escaping the markup characters (and quotes for attribute values)
+static void xmlAddEscaped(xmlbuffer* b, const char* s, size_t len, int attribute)
+{
+	size_t start = 0;
+	size_t i;
+	const char* entity;
+
+	for (i = 0; i < len; i++)
+	{
+		switch (s[i])
+		{
+			case '&': entity = "&amp;"; break;
+			case '<': entity = "&lt;"; break;
+			case '>': entity = "&gt;"; break;
+			case '"': entity = (attribute ? "&quot;" : NULL); break;
+			default: entity = NULL;
+		}
+		if (entity != NULL)
+		{
+			xmlAdd(b, s + start, i - start);
+			xmlAddString(b, entity);
+			start = i + 1;
+		}
+	}
+	xmlAdd(b, s + start, len - start);
+}
+
+// Checks an element name, only rejects what would break the markup, the
+// parser does the rest
+static int xmlValidName(const char* name)
+{
+	if (name == NULL || *name == '\0') return FALSE;
+	return (strpbrk(name, " \t\r\n<>&\"'=/") == NULL);
+}
+
+// Adds an element with a text value, a NULL value results in an empty
+// element (like pupnp does for UpnpAddToActionResponse)
+static void xmlAddElement(xmlbuffer* b, const char* name, const char* value, size_t len)
+{
+	if (!xmlValidName(name))
+	{
+		if (b->err == UPNP_E_SUCCESS) b->err = UPNP_E_INVALID_PARAM;
+		return;
+	}
+	xmlAdd(b, "<", 1);
+	xmlAddString(b, name);
+	xmlAdd(b, ">", 1);
+	if (value != NULL) xmlAddEscaped(b, value, len, FALSE);
+	xmlAdd(b, "</", 2);
+	xmlAddString(b, name);
+	xmlAdd(b, ">", 1);
+}
+
+// Parses the buffer into a document and releases the buffer.
+// Returns UPNP_E_SUCCESS, or an error code (doc will be NULL)
+int xmlParse(xmlbuffer* b, IXML_Document** doc)
+{
+	int err = b->err;
+
+	*doc = NULL;
+	if (err == UPNP_E_SUCCESS && xmlReserve(b, 0))
+	{
+		b->data[b->len] = '\0';
+		if (ixmlParseBufferEx(b->data, doc) != IXML_SUCCESS)
+		{
+			*doc = NULL;
+			err = UPNP_E_INVALID_PARAM;
+		}
+	}
+	else if (err == UPNP_E_SUCCESS)
+		err = b->err;
+	xmlFree(b);
+	return err;
+}
+
+void xmlStartActionResponse(xmlbuffer* b, const char* action, const char* servicetype)
+{
+	if (!xmlValidName(action) || servicetype == NULL)
+	{
+		if (b->err == UPNP_E_SUCCESS) b->err = UPNP_E_INVALID_PARAM;
+		return;
+	}
+	xmlAdd(b, "<u:", 3);
+	xmlAddString(b, action);
+	xmlAddString(b, "Response xmlns:u=\"");
+	xmlAddEscaped(b, servicetype, strlen(servicetype), TRUE);
+	xmlAdd(b, "\">", 2);
+}
+
+void xmlEndActionResponse(xmlbuffer* b, const char* action)
+{
+	if (action == NULL) return;		// already flagged by the start
+	xmlAdd(b, "</u:", 4);
+	xmlAddString(b, action);
+	xmlAddString(b, "Response>");
+}
+
+void xmlStartPropertySet(xmlbuffer* b)
+{
+	xmlAddString(b, XML_PROPERTYSET_START);
+}
+
+void xmlEndPropertySet(xmlbuffer* b)
+{
+	xmlAddString(b, XML_PROPERTYSET_END);
+}
+
+// Adds an output argument to an action response
+void xmlAddArgument(xmlbuffer* b, const char* name, const char* value, size_t len)
+{
+	xmlAddElement(b, name, value, len);
+}
+
+// Adds a statevariable to a property set
+void xmlAddProperty(xmlbuffer* b, const char* name, const char* value, size_t len)
+{
+	xmlAddString(b, XML_PROPERTY_START);
+	xmlAddElement(b, name, value, len);
+	xmlAddString(b, XML_PROPERTY_END);
+}
+
+// Adds the names and values from 2 Lua arrays (at stack indices 'names' and
+// 'values'), until the first nil name. Adds properties if 'properties' is
+// TRUE, arguments otherwise. Names must be strings or numbers, other values
+// (nil) result in empty elements.
+void xmlAddLuaArrays(lua_State *L, xmlbuffer* b, int names, int values, int properties)
+{
+	const char* name;
+	const char* value;
+	size_t len = 0;
+	int i = 1;
+
+	lua_checkstack(L, 2);
+	while (b->err == UPNP_E_SUCCESS)
+	{
+		lua_rawgeti(L, names, i);
+		if (lua_isnil(L, -1))
+		{
+			lua_pop(L, 1);
+			break;
+		}
+		lua_rawgeti(L, values, i);
+		// these are copies, so converting numbers does not alter the tables
+		name = (lua_isstring(L, -2) ? lua_tostring(L, -2) : NULL);
+		value = (lua_isstring(L, -1) ? lua_tolstring(L, -1, &len) : NULL);
+		if (properties)
+			xmlAddProperty(b, name, value, len);
+		else
+			xmlAddArgument(b, name, value, len);
+		lua_pop(L, 2);
+		i++;
+	}
+}
@@ -0,0 +1,34 @@
+#ifndef LuaUPnPxml_h
+#define LuaUPnPxml_h
+
+#include <lua.h>
+#include <stdlib.h>
+#include <string.h>
+#include "upnptools.h"
+#include "luaUPnPdefinitions.h"
+
+/*
+** ===============================================================
+**   XML serializer for action responses and property sets
+** ===============================================================
+*/
+
+typedef struct _xmlbuffer {
+	char* data;
+	size_t len;			// length of the content
+	size_t size;		// allocated size
+	int err;			// UPNP_E_SUCCESS, or the first error that occurred
+} xmlbuffer;
+
+void xmlInit(xmlbuffer* b, size_t hint);
+void xmlFree(xmlbuffer* b);
+int xmlParse(xmlbuffer* b, IXML_Document** doc);
+void xmlStartActionResponse(xmlbuffer* b, const char* action, const char* servicetype);
+void xmlEndActionResponse(xmlbuffer* b, const char* action);
+void xmlStartPropertySet(xmlbuffer* b);
+void xmlEndPropertySet(xmlbuffer* b);
+void xmlAddArgument(xmlbuffer* b, const char* name, const char* value, size_t len);
+void xmlAddProperty(xmlbuffer* b, const char* name, const char* value, size_t len);
+void xmlAddLuaArrays(lua_State *L, xmlbuffer* b, int names, int values, int properties);
+
+#endif  /* LuaUPnPxml_h */
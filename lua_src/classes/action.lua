@@ -178,29 +178,50 @@ assert(argument.classname == "argument")
 end
 
 
+-- Looks up a positional parameter value by its (lowercase) name. Checks the expected
+-- position first, as the parameters should be in the order of the service description.
+local findparam = function(names, values, name, position)
+    if names[position] == name then
+        return values[position]
+    end
+    for i = 1, #names do
+        if names[i] == name then
+            return values[i]
+        end
+    end
+end
+
 -----------------------------------------------------------------------------------------
 -- Checks parameters, completeness and conversion to Lua values/types.
 -- <br><strong>NOTE:</strong> a copy of the table is returned, so the original table will not be modified.
--- @param params table with parameters provided (key value list, where key is the parameter name, value is the Lua typed value)
+-- @param params table with parameters provided (key value list, where key is the parameter name, value is the Lua typed value),
+-- or if <code>names</code> is provided, an array with the values in document order
+-- @param names (optional) array with the lowercase parameter names, in document order (see <code>lib.SetPositionalParams()</code>)
 -- @return params table, or <code>nil + errormsg + errornumber</code> in case of an error
-function action:checkparams(params)
-    -- convert parameters to lowercase for matching
-    local lcase = {}
-    for name, value in pairs(params) do
-        lcase[string.lower(name)] = value
+function action:checkparams(params, names)
+    local checked = {}
+    if not names then
+        -- convert parameters to lowercase for matching
+        for name, value in pairs(params) do
+            checked[string.lower(name)] = value
+        end
     end
-    params = lcase
-    lcase = nil
     -- now check parameters
     if self.argumentcount > 0 then
         local i = 1;
         local p = self.argumentlist[i]
         while p do
             if p.direction ~= "out" then
-                if params[p.name] then
-                    local success, val, errstr, errnr = pcall(p.check, p, params[p.name])
+                local value
+                if names then
+                    value = findparam(names, params, p.name, i)
+                else
+                    value = checked[p.name]
+                end
+                if value then
+                    local success, val, errstr, errnr = pcall(p.check, p, value)
                     if success and val ~= nil then     -- pcall succeeded and a value was returned
-                        params[p.name] = val    -- now converted to Lua type, replace UPnP type
+                        checked[p.name] = val    -- now converted to Lua type, replace UPnP type
                     else
                         -- failure, report error and exit
                         if not success then
@@ -221,7 +242,7 @@ function action:checkparams(params)
         end
     end
     -- succeeded, return updated list
-    return params
+    return checked
 end
 
 -----------------------------------------------------------------------------------------
@@ -361,13 +361,15 @@ end
 -- <br>Call order: <code>device:executeaction() -&gt; action:checkparams() -&gt; service:executeaction() -&gt; action:execute() -&gt; action:checkresults()</code>
 -- @param serviceid ServiceId string, or service table/object
 -- @param actionname Name of the action to execute, or action table/object
--- @param params table with argument values, indexed by argument name.
+-- @param params table with argument values, indexed by argument name, or if <code>names</code> is provided,
+-- an array with the argument values in document order
+-- @param names (optional) array with the lowercase argument names, in document order
 -- @return 2 lists (names and values) of the 'out' arguments (in proper UPnP order), or <code>nil, errormsg, errornumber</code> upon failure
 -- @see service:executeaction
 -- @see action:execute
 -- @see action:checkparams
 -- @see action:checkresults
-function device:executeaction(serviceid, actionname, params)
+function device:executeaction(serviceid, actionname, params, names)
   logger:debug("device:executeaction(), entering...")
   -- find service
   local service
@@ -393,7 +395,7 @@ function device:executeaction(serviceid, actionname, params)
   logger:debug("device:executeaction(), action was found...")
   -- check params
   local checked, errmsg, errnr
-  checked, errmsg, errnr = action:checkparams(params or {})
+  checked, errmsg, errnr = action:checkparams(params or {}, names)
   if not checked then
     return nil, errmsg, errnr
   end
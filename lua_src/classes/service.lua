@@ -9,11 +9,38 @@
 local classname = "service"
 local super = upnp.classes.upnpbase
 local logger = upnp.logger
+local copas = require("copas.timer")
 
 -----------------
 -- LOCAL STUFF --
 -----------------
 
+-- Builds the cached lists with the names and values of the evented statevariables, and the
+-- index of each variable in the lists. See service:getupnpvalues()
+local buildupnpvalues = function(service)
+    local names, values, index = {}, {}, {}
+    for _, v in pairs(service.servicestatetable or {}) do
+        if v.sendevents then    -- only if evented
+            names[#names + 1] = v._name     -- use original casing for name here
+            values[#names] = v:getupnp()
+            index[v] = #names
+        end
+    end
+    service._upnpnames, service._upnpvalues, service._upnpindex = names, values, index
+end
+
+-- LastChange event namespaces by service type, default is the AVTransport one
+local lastchangenamespaces = {
+    RenderingControl = "urn:schemas-upnp-org:metadata-1-0/RCS/",
+    default = "urn:schemas-upnp-org:metadata-1-0/AVT/",
+}
+
+-- Escapes a value for use in an XML attribute
+local xmlescapes = { ["&"] = "&amp;", ["<"] = "&lt;", [">"] = "&gt;", ['"'] = "&quot;", ["'"] = "&apos;" }
+local xmlescape = function(value)
+    return (string.gsub(tostring(value), "[&<>\"']", xmlescapes))
+end
+
 
 --------------------------
 -- CLASS IMPLEMENTATION --
@@ -28,6 +55,9 @@ local logger = upnp.logger
 -- @field parent the device owning this service
 -- @field actionlist list of actions, indexed by their name
 -- @field statetable list of statevariables, indexed by their name
+-- @field lastchangerate (optional, services with a <code>LastChange</code> statevariable only) number of seconds
+-- changes are collected before a new <code>LastChange</code> value is set, default 0.2
+-- @field lastchangenamespace (optional) namespace of the <code>LastChange</code> event, by default based on the service type
 local service = super:subclass()
 
 -----------------------------------------------------------------------------------------
@@ -191,6 +221,7 @@ assert(statevar.classname == "statevariable")
 
     self.servicestatetable = self.servicestatetable or {}
     self.servicestatetable[statevar.name] = statevar
+    self._upnpnames, self._upnpvalues, self._upnpindex = nil, nil, nil    -- rebuild cached values
     -- update statevariable
     statevar.parent = self
 end
@@ -242,19 +273,139 @@ function service:executeaction(actionname, params)
 end
 
 -----------------------------------------------------------------------------------------
--- Creates a list of all variables and values, to be provided when a subscription is accepted
+-- Returns the lists of all evented variables and values, to be provided when a subscription is accepted.
+-- The lists are cached and kept up to date by <code>updateupnpvalue()</code>, so they must not be modified.
 -- @return list with variablenames
 -- @return list with variablevalues (order matching the name list)
+-- @see service:updateupnpvalue
 function service:getupnpvalues()
-    local names = {}
-    local values = {}
-    for _, v in pairs(self.servicestatetable) do
-        if v.sendevents then    -- only if evented
-            table.insert(names, v._name)    -- use original casing for name here
-            table.insert(values, v:getupnp())
+    if not self._upnpnames then buildupnpvalues(self) end
+    return self._upnpnames, self._upnpvalues
+end
+
+-----------------------------------------------------------------------------------------
+-- Updates the value of an evented statevariable in the cached lists returned by
+-- <code>getupnpvalues()</code>. Called by <code>statevariable:set()</code> when the value changes.
+-- @param statevariable the statevariable (table/object) whose value has changed
+-- @see service:getupnpvalues
+function service:updateupnpvalue(statevariable)
+    local i = self._upnpindex and self._upnpindex[statevariable]
+    if i then self._upnpvalues[i] = statevariable:getupnp() end
+end
+
+-----------------------------------------------------------------------------------------
+-- Queues an event for a changed statevariable. The changes are collected per service and sent
+-- to the subscribers in a single event, when the current Lua dispatch is complete, or after
+-- <code>upnp.notifywindow</code> seconds. If <code>upnp.notifywindow</code> is <code>false</code>
+-- the change is sent immediately.
+-- @param statevariable the evented statevariable (table/object) whose value has changed
+-- @see service:flushnotify
+function service:notify(statevariable)
+    if upnp.notifywindow == false then
+        local handle = self:gethandle()
+        if handle then
+            handle:Notify(self:getdevice():getudn(), self.serviceid, statevariable._name, statevariable:getupnp())
         end
+        return
+    end
+    self._notifypending = self._notifypending or {}
+    self._notifypending[statevariable._name] = statevariable:getupnp()    -- only the last value is sent
+    if not self._notifyarmed then
+        if not self._notifytimer then
+            self._notifytimer = copas.newtimer(nil, function() self:flushnotify() end, nil, false, nil)
+        end
+        self._notifyarmed = true
+        self._notifytimer:arm(tonumber(upnp.notifywindow) or 0)
+    end
+end
+
+-----------------------------------------------------------------------------------------
+-- Sends the queued statevariable changes to the subscribers, in a single event.
+-- Is called automatically, see <code>service:notify()</code>.
+-- @see service:notify
+function service:flushnotify()
+    local pending = self._notifypending
+    self._notifypending = nil
+    self._notifyarmed = nil
+    if not pending or not next(pending) then return end
+    local handle = self:gethandle()
+    if not handle then return end       -- device not (or no longer) registered
+    local names, values = {}, {}
+    for name, value in pairs(pending) do
+        names[#names + 1] = name
+        values[#names] = value
+    end
+    local result, err = handle:Notify(self:getdevice():getudn(), self.serviceid, names, values)
+    if not result then
+        logger:error("service:flushnotify() failed sending the event for service '%s'; %s", tostring(self.serviceid), tostring(err))
+    end
+end
+
+-----------------------------------------------------------------------------------------
+-- Collects a variable change for the <code>LastChange</code> statevariable (AV style instance based services).
+-- The changes are collected per instance, and rendered into a single <code>LastChange</code> value after
+-- <code>lastchangerate</code> seconds, which is then evented as usual. Changes of the statevariables of the
+-- service are collected automatically (as instance 0) by <code>service:afterset()</code>, for the non-evented
+-- variables, unless the statevariable field <code>lastchange</code> is set. Instance variables that have
+-- no statevariable object should be reported by calling this method.
+-- @param instanceid the instance number
+-- @param name the variable name (original casing)
+-- @param value the new value, in UPnP format
+-- @return 1 on success, or <code>nil + error</code> if the service has no <code>LastChange</code> statevariable
+-- @see service:flushlastchange
+function service:lastchange(instanceid, name, value)
+    if not self:getstatevariable("lastchange") then
+        return nil, "service '" .. tostring(self.serviceid) .. "' has no LastChange statevariable"
+    end
+    instanceid = tonumber(instanceid) or 0
+    self._lastchangepending = self._lastchangepending or {}
+    local instance = self._lastchangepending[instanceid]
+    if not instance then
+        instance = { names = {}, values = {} }
+        self._lastchangepending[instanceid] = instance
+    end
+    if instance.values[name] == nil then table.insert(instance.names, name) end
+    instance.values[name] = tostring(value)     -- only the last value is sent
+    if not self._lastchangearmed then
+        if not self._lastchangetimer then
+            self._lastchangetimer = copas.newtimer(nil, function() self:flushlastchange() end, nil, false, nil)
+        end
+        self._lastchangearmed = true
+        self._lastchangetimer:arm(tonumber(self.lastchangerate) or 0.2)
+    end
+    return 1
+end
+
+-----------------------------------------------------------------------------------------
+-- Renders the collected changes into a new <code>LastChange</code> value, and sets it.
+-- Is called automatically, see <code>service:lastchange()</code>.
+-- @see service:lastchange
+function service:flushlastchange()
+    local pending = self._lastchangepending
+    self._lastchangepending = nil
+    self._lastchangearmed = nil
+    local statevar = self:getstatevariable("lastchange")
+    if not pending or not statevar then return end
+    local ids = {}
+    for id in pairs(pending) do ids[#ids + 1] = id end
+    table.sort(ids)
+    local ns = self.lastchangenamespace or
+               lastchangenamespaces[string.match(self.servicetype or "", ":service:([^:]+)") or ""] or
+               lastchangenamespaces.default
+    local xml = { '<Event xmlns="', ns, '">' }
+    for _, id in ipairs(ids) do
+        local instance = pending[id]
+        xml[#xml + 1] = '<InstanceID val="' .. id .. '">'
+        for _, name in ipairs(instance.names) do
+            xml[#xml + 1] = '<' .. name .. ' val="' .. xmlescape(instance.values[name]) .. '"/>'
+        end
+        xml[#xml + 1] = '</InstanceID>'
+    end
+    xml[#xml + 1] = '</Event>'
+    local result, err = statevar:set(table.concat(xml))
+    if result == nil then
+        logger:error("service:flushlastchange() failed setting LastChange for service '%s'; %s", tostring(self.serviceid), tostring(err))
     end
-    return names, values
 end
 
 -----------------------------------------------------------------------------------------
@@ -291,6 +442,14 @@ end
 -- @see statevariable:beforeset
 -- @see service:beforeset
 function service:afterset(statevariable, oldval)
+  local lc = statevariable.lastchange
+  if lc == nil then
+    -- by default the non-evented variables, except the argument types
+    lc = not statevariable.sendevents and string.sub(statevariable.name or "", 1, 11) ~= "a_arg_type_"
+  end
+  if lc and statevariable.name ~= "lastchange" and self:getstatevariable("lastchange") then
+    self:lastchange(0, statevariable._name, statevariable:getupnp())
+  end
   if self.parent and self.parent.afterset then
     return self.parent:afterset(self, statevariable, oldval)
   else
@@ -10,6 +10,8 @@ local classname = "statevariable"
 local super = upnp.classes.upnpbase
 
 local date = require("date")
+local copas = require("copas.timer")
+local gettime = require("socket").gettime
 local logger = upnp.logger
 
 -----------------
@@ -92,6 +94,12 @@ end
 -- @name statevariable fields/properties
 -- @field name name of the statevariable
 -- @field sendevents indicator for the variable to be an evented statevariable
+-- @field maximumrate (optional, evented variables only) minimum number of seconds between events for the
+-- variable. Changes within that period are not evented, the latest value is evented when the period ends.
+-- @field minimumdelta (optional, evented numeric variables only) minimum change compared to the last
+-- evented value, before a new value is evented.
+-- @field lastchange (optional, services with a <code>LastChange</code> statevariable only) whether changes
+-- are reported through <code>LastChange</code>, by default the non-evented variables are, see <code>service:lastchange()</code>.
 -- @field _value internal field holding the value, use <a href="#statevariable:get"><code>get()</code></a>, <a href="#statevariable:set"><code>set()</code></a> and <a href="#statevariable:getupnp"><code>getupnp()</code></a> methods for access
 -- @field _datatype internal field holding the UPnP type, use <a href="#statevariable:getdatatype"><code>getdatatype()</code></a> and <a href="#statevariable:setdatatype"><code>setdatatype()</code></a> methods for access
 local statevariable = super:subclass()
@@ -116,6 +124,11 @@ function statevariable:initialize()
     end
     self.sendevents = (evt == 1)        -- is the variable evented or not, make it a Lua boolean
     self.sendEvents = nil
+    -- event moderation, numbers or nil
+    self.maximumrate = tonumber(self.maximumRate or self.maximumrate)
+    self.maximumRate = nil
+    self.minimumdelta = tonumber(self.minimumDelta or self.minimumdelta)
+    self.minimumDelta = nil
 
     self.parent = nil                   -- owning UPnP service of this variable
     --self.allowedvaluelist = nil         -- set of possible values (set: keys and values are the same!) for UPnP type 'string' only
@@ -437,6 +450,39 @@ function statevariable:afterset(oldval)
   end
 end
 
+-----------------------------------------------------------------------------------------
+-- Events the current value to the subscribers, moderated according to the <code>maximumrate</code>
+-- and <code>minimumdelta</code> fields. Called by <code>set()</code>, only for evented variables.
+-- @see statevariable:set
+function statevariable:sendevent()
+    if self.minimumdelta and type(self._value) == "number" and type(self._eventedvalue) == "number" and
+       math.abs(self._value - self._eventedvalue) < self.minimumdelta then
+        return      -- change too small
+    end
+    if self.maximumrate and self._eventedtime then
+        local wait = self._eventedtime + self.maximumrate - gettime()
+        if wait > 0 then
+            -- too soon, event the latest value when the period ends
+            if not self._moderated then
+                if not self._moderatetimer then
+                    self._moderatetimer = copas.newtimer(nil, function()
+                            self._moderated = nil
+                            if self._value ~= self._eventedvalue then self:sendevent() end
+                        end, nil, false, nil)
+                end
+                self._moderated = true
+                self._moderatetimer:arm(wait)
+            end
+            return
+        end
+    end
+    local service = self:getservice()
+    if not service then return end
+    self._eventedvalue = self._value
+    self._eventedtime = gettime()
+    service:notify(self)            -- coalesced with other changes of the service
+end
+
 -----------------------------------------------------------------------------------------
 -- Sets the statevariable value.
 -- Any value provided will be converted to the corresponding Lua type
@@ -469,11 +515,16 @@ function statevariable:set(value, noevent)
         end
         logger:debug("statevariable:set() setting variable '%s' to '%s'", self._name, tostring(newval))
         self._value = newval              -- set new value, fire event
+        local service = self:getservice()
+        if service and self.sendevents then
+            service:updateupnpvalue(self)   -- keep the initial event values for new subscribers current
+        end
+        if self._stored then
+            -- update the native state store before eventing
+            upnp.lib.StoreSetVariable(self:getdevice():getudn(), self:getservice().serviceid, self._name, self:getupnp())
+        end
         if self.sendevents and not noevent then
-            local handle = self:gethandle()
-            if handle then
-                handle:Notify(self:getdevice():getudn(), self:getservice().serviceid, self._name, self:getupnp())
-            end
+            self:sendevent()
         end
         -- call the after handler
         if self.afterset then
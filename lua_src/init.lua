@@ -34,6 +34,43 @@ local myDescription = "Lua enabled UPnP engine, copyright 2013 Thijs Schreijer,
 -- @field webroot path of the web-root directory
 -- @field baseurl base url pointing to the web-root directory
 -- @field configroot base directory for configuration information
+-- @field batchsize maximum number of async events (SSDP, GENA, SOAP results) delivered
+-- to Lua in a single callback, set before UPnP is started. Default 0 disables batching.
+-- @field ringsize if set (before UPnP is started), async events bypass DSS and are delivered
+-- through a native ring with room for this many events. Events not fitting are dropped.
+-- Default 0 disables the ring.
+-- @field queuelimits table with limits for events waiting to be handled, per event class
+-- (<code>SSDP, SOAP, GENA, DEVICE</code>), set before UPnP is started. Each entry is a table with
+-- fields <code>limit</code> (0 is unlimited) and <code>policy</code> (<code>"dropoldest", "dropnewest"</code>
+-- or <code>"block"</code>; "dropoldest" requires <code>batchsize</code>, "block" is only for <code>DEVICE</code>). Example: <code>upnp.queuelimits.SSDP = { limit = 500, policy = "dropoldest" }</code>
+-- @field dedupsize if set (before UPnP is started), repeated SSDP advertisements (same
+-- DeviceID, ServiceType and Location) are suppressed by the core lib until half their 'Expires'
+-- period has passed. The value is the max number of cached advertisements. Default 0 disables it.
+-- @field lazyevents if <code>true</code>, async events are delivered as lazy event objects (userdata)
+-- instead of tables. Fields are only created when accessed, but the objects cannot be traversed
+-- with <code>pairs()</code> and are read-only. Default <code>false</code>.
+-- @field eventclasses if set (before UPnP is started), a table with the event classes to handle
+-- (<code>SSDP, SOAP, GENA, DEVICE</code>) as keys and <code>true</code> as values. Each event type of an
+-- enabled class gets its own handler in the core lib, event types of the other classes are dropped
+-- by the core lib. Example for a device-only node: <code>upnp.eventclasses = { DEVICE = true }</code>.
+-- Default <code>nil</code> handles all events through a single callback.
+-- @field nativestore if <code>true</code> (set before devices are started), the values of the evented
+-- statevariables and those of the <code>genericgetter</code> actions are mirrored in the core lib. Getter
+-- actions and subscription requests are then answered by the core lib, without calling Lua. Default <code>false</code>.
+-- @field positionalparams if <code>true</code> (set before UPnP is started), the arguments of action requests
+-- are delivered as arrays in document order, with pre-lowercased names, instead of a table keyed by name.
+-- Default <code>false</code>.
+-- @field requestdeadline if set (before UPnP is started), the max number of milliseconds action and
+-- subscription requests wait for a Lua response. When it passes, the action fails with error 501 and the
+-- subscription is not accepted, a late response is discarded. Default 0 waits indefinitely.
+-- @field latencystats if <code>true</code>, the core lib records latency histograms for each stage of
+-- the callback pipeline, see <code>lib.GetLatencyStats()</code>. Default <code>false</code>.
+-- @field notifywindow number of seconds changes of evented statevariables are collected, before
+-- they are sent to the subscribers in a single event per service. Default 0 collects the changes made
+-- while handling a single event (eg. an action), <code>false</code> sends each change immediately.
+-- @field recycleevents if set (before UPnP is started), the number of async event tables the core lib
+-- reuses, instead of creating new ones. The tables are cleared when the next event (or batch) is delivered,
+-- so event handlers must not keep a reference to them. Default 0 disables recycling.
 -- @field lib contains the mapped functions of pupnp library
 -- @field lib.web contains the mapped functions of upnp web methods
 -- @field lib.http contains the mapped functions of upnp http methods
@@ -63,7 +100,7 @@ function print(...)
 end
 
 logger:debug("Loading LuaSocket")
-require('socket')                           -- unused value, but must load BEFORE uuid
+local socket = require('socket')             -- must load BEFORE uuid
 logger:debug("Loading uuid")
 local uuid = require("uuid")     
 uuid.seed()                        
@@ -96,6 +133,18 @@ upnp.classes.argument      = require("upnp.classes.argument")
 upnp.devices = {}          -- global list of UPnP devices, by their UDN
 upnp.lib = lib             -- export the core UPnP lib
 upnp.configroot = "./"     -- base directory for configuration information
+upnp.batchsize = 0         -- max async events per callback, 0 = no batching
+upnp.ringsize = 0          -- size of native event ring, 0 = deliver through DSS
+upnp.queuelimits = {}      -- limits per event class, none by default
+upnp.dedupsize = 0         -- size of SSDP deduplication cache, 0 = no deduplication
+upnp.lazyevents = false    -- deliver async events as tables
+upnp.eventclasses = nil    -- handle all event classes through a single callback
+upnp.nativestore = false   -- answer getters and subscriptions from Lua
+upnp.positionalparams = false  -- deliver action arguments keyed by name
+upnp.requestdeadline = 0   -- wait indefinitely for Lua to answer requests
+upnp.latencystats = false  -- no latency statistics
+upnp.recycleevents = 0     -- create a new table for each async event
+upnp.notifywindow = 0      -- send the changes of a single event handler in one notification
 
 -- webserver setup
 logger:debug("Configuring webserver")
@@ -224,12 +273,9 @@ EventTypeHandlers = {
             if not hdl then
                 return upnperror(string.format("%s: device '%s' has no valid handle (bug??)", event.Event, tostring(event.UDN)))
             end
-            local names, values = service:getupnpvalues()
+            local names, values = service:getupnpvalues()     -- cached lists, kept up to date by the service
             deliverycb(device:gethandle(), names, values)   -- getupnpvalues returns 2 tables!!
             logger:info("Subscription accepted, for service '%s' @ device '%s'", tostring(event.ServiceID), tostring(event.UDN))
-            logger:debug("send the following statevariable list (names and values)")
-            logger:debug(names)
-            logger:debug(values)
             return 1
         elseif event.Event == "UPNP_CONTROL_ACTION_REQUEST" then
             local errstr, errnr, names, values
@@ -239,7 +285,7 @@ EventTypeHandlers = {
                 errnr = 501
             else
                 -- execute it
-                names, values, errnr = device:executeaction(event.ServiceID, event.ActionName, event.Params)
+                names, values, errnr = device:executeaction(event.ServiceID, event.ActionName, event.ParamValues or event.Params, event.ParamNames)
                 if not names then
                     -- failed, switch variables
                     errstr = values
@@ -273,26 +319,60 @@ EventTypeHandlers = {
     end,
 }
 
+-- Dispatches a single event to the appropriate function from the <code>EventTypeHandlers</code> table
+local dispatchevent = function(event, deliverycb)
+    logger:debug("UPnPCallback: received UPnP event; ")
+    logger:debug(event)
+    local et = UPnPEvents[event.Event].type
+    if EventTypeHandlers[et] then
+        -- execute handler for the received event type
+        EventTypeHandlers[et](event, deliverycb);
+    end
+end
+
+-- Creates a handler for a single event type, to be registered with the core lib.
+-- The core lib calls it directly, so the <code>UPnPEvents</code> lookup is skipped.
+local typehandler = function(eventtype)
+    local handler = EventTypeHandlers[eventtype.type]
+    return function(deliverycb, event)
+        if type(deliverycb) ~= "userdata" or event == nil then
+            -- no callback; async event (table or lazy event object)
+            event = deliverycb
+            deliverycb = nil
+        end
+        logger:debug("UPnPCallback: received UPnP event; ")
+        logger:debug(event)
+        return handler(event, deliverycb)
+    end
+end
+
 ---------------------------------------------------------------------
 -- Callback function, executed whenever a UPnP event arrives through DSS.
 -- It will call the appropriate function from the <code>EventTypeHandlers</code> table
 -- *param deliverycb waitingthread_callback, which must be called
--- *param event table with event parameters
+-- *param event table with event parameters, or in batch mode an array of event tables
+-- (with field <code>n</code> holding the number of events)
 local UPnPCallback = function (deliverycb, event)
     local err
-    if type(deliverycb) ~= "userdata" then
+    if type(deliverycb) ~= "userdata" or event == nil then
+        -- no callback; async event (table or lazy event object), or an error
         err = event
         event = deliverycb
         deliverycb = nil
     end
     if event then
         -- we've got an event to handle
-        logger:debug("UPnPCallback: received UPnP event; ")
-        logger:debug(event)
-        local et = UPnPEvents[event.Event].type
-        if EventTypeHandlers[et] then
-            -- execute handler for the received event type
-            EventTypeHandlers[et](event, deliverycb);
+        if event.Event then
+            dispatchevent(event, deliverycb)
+        else
+            -- a batch of async events, no deliverycb. The records are released
+            -- already, so a failing handler must not lose the remaining events
+            for i = 1, (event.n or #event) do
+                local success, err = pcall(dispatchevent, event[i])
+                if not success then
+                    upnperror("UPnPCallback(): error handling event from batch; " .. tostring(err))
+                end
+            end
         end
     else
         -- an error occured
@@ -300,6 +380,33 @@ local UPnPCallback = function (deliverycb, event)
     end
 end
 
+-- Sets up delivery of async events through the native ring of the core lib.
+-- A UDP socket on localhost is signalled by the lib whenever events are waiting,
+-- it is added to Copas similar to the DSS socket.
+local startring = function()
+    local skt = socket.udp()
+    skt:setsockname("127.0.0.1", 0)
+    local _, port = skt:getsockname()
+    local success, err = lib.SetRingDelivery(port, upnp.ringsize)
+    if not success then
+        skt:close()
+        return upnperror("Failed to start the event ring, falling back to DSS delivery; " .. tostring(err))
+    end
+    copas.addserver(skt, function(skt)
+            skt = copas.wrap(skt)
+            while true do
+                skt:receive()
+                local events = lib.DrainRing()
+                if events then
+                    -- protected, an error must not end this loop, nothing would drain the ring anymore
+                    local success, err = pcall(UPnPCallback, events)
+                    if not success then upnperror("Error handling events from the ring; " .. tostring(err)) end
+                end
+            end
+        end)
+    return 1
+end
+
 -- Event handler to handle Copas start/stop events as
 -- generated by copas.eventer
 local CopasEventHandler = function(self, sender, event)
@@ -315,6 +422,43 @@ local CopasEventHandler = function(self, sender, event)
         -- do initialization
         logger:debug("Starting UPnP library...")
         lib.Init(UPnPCallback)         -- start, attach event handler for UPnP events
+        if (upnp.batchsize or 0) > 0 then
+            lib.SetBatchDelivery(upnp.batchsize)    -- deliver async events in batches
+        end
+        if (upnp.ringsize or 0) > 0 then
+            startring()                 -- deliver async events through native ring
+        end
+        if (upnp.dedupsize or 0) > 0 then
+            local success, err = lib.SetDedupCache(upnp.dedupsize)   -- suppress repeated SSDP advertisements
+            if not success then upnperror("Failed setting the SSDP cache size; " .. tostring(err)) end
+        end
+        if upnp.lazyevents then
+            lib.SetLazyEvents(true)     -- deliver async events as lazy event objects
+        end
+        if (upnp.recycleevents or 0) > 0 then
+            lib.SetEventRecycling(upnp.recycleevents)   -- reuse async event tables
+        end
+        if upnp.positionalparams then
+            lib.SetPositionalParams(true)   -- deliver action arguments as arrays
+        end
+        if upnp.latencystats then
+            lib.SetLatencyStats(true)   -- record latency histograms
+        end
+        if (upnp.requestdeadline or 0) > 0 then
+            lib.SetRequestDeadline(upnp.requestdeadline)    -- fail requests not answered in time
+        end
+        if upnp.eventclasses then
+            -- register handlers per event type, other types are dropped by the core lib
+            for name, eventtype in pairs(UPnPEvents) do
+                if upnp.eventclasses[eventtype.type] then
+                    lib.SetEventHandler(name, typehandler(eventtype))
+                end
+            end
+        end
+        for class, l in pairs(upnp.queuelimits or {}) do
+            local success, err = pcall(lib.SetQueueLimit, class, l.limit or 0, l.policy)
+            if not success then upnperror("Failed setting queue limit for " .. tostring(class) .. "; " .. tostring(err)) end
+        end
         lib.web.SetRootDir(upnp.webroot)    -- setup the webserver
         upnp.baseurl = "http://" .. lib.GetServerIpAddress() .. ":" .. lib.GetServerPort() .. "/";
         -- raise event done
@@ -339,6 +483,44 @@ local CopasEventHandler = function(self, sender, event)
     end
 end
 
+-----------------------------------------------------------------------------------------
+-- Fills the native state store with the evented statevariables and the generic getter
+-- actions of a device and its sub-devices.
+-- @param dev the device to store
+-- @param hdl the handle of the root device
+local function storedevice(dev, hdl)
+    local udn = dev:getudn()
+    for _, service in pairs(dev.servicelist or {}) do
+        local add = function(statevar)
+            local success, err = lib.StoreAddVariable(hdl, udn, service.serviceid, statevar._name, statevar:getupnp(), statevar.sendevents)
+            statevar._stored = success and true
+            if not success then upnperror("Failed adding statevariable to the native store; " .. tostring(err)) end
+            return statevar._stored
+        end
+        for _, statevar in pairs(service.servicestatetable or {}) do
+            if statevar.sendevents then add(statevar) end
+        end
+        for _, action in pairs(service.actionlist or {}) do
+            if action.execute == upnp.classes.action.genericgetter then
+                local args, vars, complete = {}, {}, true
+                for _, arg in ipairs(action.argumentlist or {}) do
+                    if arg.direction == "out" then
+                        complete = complete and add(arg.statevariable)
+                        table.insert(args, arg._name)       -- use original casing
+                        table.insert(vars, arg.statevariable._name)
+                    end
+                end
+                if complete then
+                    lib.StoreAddGetter(udn, service.serviceid, action._name, args, vars)
+                end
+            end
+        end
+    end
+    for _, subdev in pairs(dev.devicelist or {}) do
+        storedevice(subdev, hdl)
+    end
+end
+
 -----------------------------------------------------------------------------------------
 -- Starts a UPnP device. Registers the device with the lib to enable network comms and callbacks.
 -- @param rootdev device object, must be a root device with the <code>rootdev.devicexmlurl</code> set
@@ -366,6 +548,9 @@ function upnp.startdevice(rootdev)
     local hdl, err = lib.RegisterRootDevice(url)
     if hdl then
         logger:info("upnp.startdevice(); advertizing '%s' with id '%s'", tostring(rootdev.friendlyname), tostring(rootdev:getudn()))
+        if upnp.nativestore then
+            storedevice(rootdev, hdl)   -- answer getters and subscriptions from the core lib
+        end
         hdl:SendAdvertisement(100)
         logger:debug("upnp.startdevice(); successfully started device")
     else